@@ -0,0 +1,122 @@
+#if !defined(ARENA_H_INCLUDED)
+#define ARENA_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for the scratch memory of one image. Freeing is a no-op and
+// reset() makes all of it available again; when an image needed more than
+// the first block the blocks are merged into one on reset, so after a few
+// images processing a similar one allocates nothing from the heap.
+struct Arena {
+    struct Block {
+        char *p;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t used = 0;            // in blocks.back()
+    size_t total = 0;           // allocated since the last reset, all blocks
+
+    Arena() {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() { for (auto& b : blocks) ::operator delete(b.p); }
+
+    void *alloc(size_t n, size_t align) {
+        n = std::max<size_t>(n, 1);
+        size_t at = blocks.empty() ? 0 : (used + align - 1) & ~(align - 1);
+        if (blocks.empty() || at + n > blocks.back().size) {
+            size_t size = std::max(n + align, std::max<size_t>(1 << 20, blocks.empty() ? 0 : blocks.back().size*2));
+            blocks.reserve(64);
+            blocks.push_back(Block{(char *)::operator new(size), size});
+            at = size_t(-uintptr_t(blocks.back().p)) & (align - 1);
+        }
+        used = at + n;
+        total += n;
+        return blocks.back().p + at;
+    }
+
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t size = 0;
+            for (auto& b : blocks) {
+                size += b.size;
+                ::operator delete(b.p);
+            }
+            blocks.clear();
+            blocks.push_back(Block{(char *)::operator new(size), size});
+        }
+        used = total = 0;
+    }
+};
+
+// Arena of the current thread, null when scratch memory comes from the heap
+inline Arena*& current_arena() {
+    thread_local Arena *a = nullptr;
+    return a;
+}
+
+// Resets an arena and makes it the current one for the lifetime of the scope
+struct ArenaScope {
+    Arena *saved;
+    ArenaScope(Arena *a) : saved(current_arena()) {
+        if (a) a->reset();
+        current_arena() = a;
+    }
+    ~ArenaScope() { current_arena() = saved; }
+};
+
+// Scratch memory of the images processed by the current thread
+inline Arena& worker_arena() {
+    thread_local Arena arena;
+    return arena;
+}
+
+// Allocator using the arena current when it was created (the heap if none).
+// Containers keep their allocator, so memory goes back where it came from
+// and copies are made in the arena current at the time of the copy.
+template<typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    Arena *arena;
+
+    ArenaAllocator() : arena(current_arena()) {}
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T *allocate(size_t n) {
+        if (arena) return (T *)arena->alloc(n*sizeof(T), alignof(T) < 16 ? 16 : alignof(T));
+        return (T *)::operator new(n*sizeof(T));
+    }
+    void deallocate(T *p, size_t) {
+        if (!arena) ::operator delete(p);
+    }
+
+    ArenaAllocator select_on_container_copy_construction() const { return ArenaAllocator(); }
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+// Heap allocations made by the current thread, counted by the global
+// operator new of sudoku.cpp
+inline long long& heap_allocations() {
+    thread_local long long n = 0;
+    return n;
+}
+
+// Per-image temporary buffer
+template<typename T>
+using Scratch = std::vector<T, ArenaAllocator<T>>;
+
+#endif
@@ -74,4 +74,7 @@ inline void parse_argv(const char *program, int argc, const char *argv[]) {
 #define PARM(type, n, descr, value)              \
     type n; new TParm<type>(&n, #n, descr, value)
 
+#define MPARM(obj, n, descr, value)              \
+    new TParm<decltype(obj.n)>(&obj.n, #n, descr, value)
+
 #endif
@@ -0,0 +1,180 @@
+#if !defined(BANK_H_INCLUDED)
+#define BANK_H_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "images.h"
+
+// Digit template bank: reference digits in a single read-only buffer, either
+// a memory mapped file (shared by every process using it) or one built in
+// memory. The file starts with a BankHeader followed by a BankDigit per
+// digit, then the pixel and point data they point to; integers are little
+// endian.
+//
+// For each digit the bank has its bounding box in the reference image, its
+// pixels, and the distance transform and gray levels around it; the matcher
+// resamples them to the candidate heights it meets.
+
+const int BANK_VERSION = 2;
+
+struct BankHeader {
+    char magic[8];              // "SDKBANK\0"
+    uint32_t version;
+    uint32_t size;              // whole file
+    uint32_t crc;               // CRC-32 of everything after the header
+    uint32_t ndigits;
+    uint32_t margin;            // patch border around bounding boxes
+    double kblur, threshold;    // binarization used to build it
+};
+
+struct BankPatch {
+    int32_t x0, y0, w, h;       // rectangle covered
+    uint32_t offset;            // w*h bytes
+};
+
+struct BankPoints {
+    uint32_t offset, count;     // count int32 x, y pairs
+};
+
+struct BankDigit {
+    int32_t x0, y0, x1, y1;
+    BankPatch dt, gray;
+    BankPoints pts;
+};
+
+// Read-only view of a rectangle of an image; reads outside give 'outside'
+struct Patch {
+    int x0 = 0, y0 = 0, w = 0, h = 0;
+    const unsigned char *data = nullptr;
+    int outside = 255;
+
+    int operator()(int x, int y) const {
+        x -= x0; y -= y0;
+        return x>=0 && y>=0 && x<w && y<h ? data[y*w+x] : outside;
+    }
+
+    // Bilinear interpolation, clamped to the patch
+    double bili(double x, double y) const {
+        int ix = std::max(x0, std::min(x0+w-2, int(x-0.5))),
+            iy = std::max(y0, std::min(y0+h-2, int(y-0.5)));
+        double fx = x-0.5 - ix, fy = y-0.5 - iy;
+        const unsigned char *p = data + (iy-y0)*w + (ix-x0);
+        return ((p[0]*(1-fx) + p[1]*fx)*(1-fy) +
+                (p[w]*(1-fx) + p[w+1]*fx)*fy);
+    }
+};
+
+struct PointList {
+    const Pixel *p = nullptr;
+    int n = 0;
+    const Pixel *begin() const { return p; }
+    const Pixel *end() const { return p + n; }
+    int size() const { return n; }
+};
+
+struct DigitTemplate {
+    int x0, y0, x1, y1;
+    Patch dt, gray;
+    PointList pts;
+};
+
+struct TemplateBank {
+    std::shared_ptr<const unsigned char> mem;
+    size_t size = 0;
+    double kblur = 0, threshold = 0;
+    std::vector<DigitTemplate> digits;
+};
+
+inline TemplateBank parseBank(std::shared_ptr<const unsigned char> mem, size_t size) {
+    const unsigned char *base = mem.get();
+    BankHeader hd;
+    if (size < sizeof(hd)) throw std::runtime_error("Template bank too short");
+    memcpy(&hd, base, sizeof(hd));
+    if (memcmp(hd.magic, "SDKBANK", 8) != 0) throw std::runtime_error("Not a template bank");
+    if (hd.version != BANK_VERSION) throw std::runtime_error("Unsupported template bank version " + std::to_string(hd.version));
+    if (hd.size != size) throw std::runtime_error("Template bank size mismatch");
+    if (pngCRC(base + sizeof(hd), size - sizeof(hd)) != hd.crc) throw std::runtime_error("Template bank checksum mismatch");
+    if (hd.ndigits != 9) throw std::runtime_error("Invalid template bank layout");
+    uint64_t tables = sizeof(hd) + uint64_t(hd.ndigits)*sizeof(BankDigit);
+    if (tables > size) throw std::runtime_error("Truncated template bank");
+    auto patch = [&](const BankPatch& bp) {
+        if (bp.w <= 0 || bp.h <= 0 || bp.w > 65536 || bp.h > 65536 ||
+            bp.offset + uint64_t(bp.w)*bp.h > size) throw std::runtime_error("Invalid template bank patch");
+        Patch p;
+        p.x0 = bp.x0; p.y0 = bp.y0; p.w = bp.w; p.h = bp.h;
+        p.data = base + bp.offset;
+        return p;
+    };
+    auto points = [&](const BankPoints& bp) {
+        if (bp.offset % 4 || bp.offset + uint64_t(bp.count)*sizeof(Pixel) > size) throw std::runtime_error("Invalid template bank points");
+        PointList pl;
+        pl.p = (const Pixel *)(base + bp.offset);
+        pl.n = bp.count;
+        return pl;
+    };
+    TemplateBank bank;
+    bank.mem = mem;
+    bank.size = size;
+    bank.kblur = hd.kblur;
+    bank.threshold = hd.threshold;
+    const unsigned char *p = base + sizeof(hd);
+    for (unsigned i=0; i<hd.ndigits; i++, p+=sizeof(BankDigit)) {
+        BankDigit bd;
+        memcpy(&bd, p, sizeof(bd));
+        if (bd.x1 <= bd.x0 || bd.y1 <= bd.y0) throw std::runtime_error("Invalid template bank digit");
+        DigitTemplate d{bd.x0, bd.y0, bd.x1, bd.y1, patch(bd.dt), patch(bd.gray), points(bd.pts)};
+        d.gray.outside = 0;
+        if (d.gray.w < 2 || d.gray.h < 2) throw std::runtime_error("Invalid template bank patch");
+        bank.digits.push_back(d);
+    }
+    return bank;
+}
+
+// Maps a bank file read-only
+inline TemplateBank loadBank(const std::string& fname) {
+    MappedFile m = mapFile(fname);
+    if (!m.data) throw std::runtime_error("Error mapping template bank '" + fname + "'");
+    return parseBank(m.data, m.size);
+}
+
+// Serializes a bank; the patches and points of the digits may point anywhere
+inline std::vector<unsigned char> serializeBank(const std::vector<DigitTemplate>& digits,
+                                                int margin, double kblur, double threshold) {
+    BankHeader hd{};
+    memcpy(hd.magic, "SDKBANK", 8);
+    hd.version = BANK_VERSION;
+    hd.ndigits = digits.size();
+    hd.margin = margin;
+    hd.kblur = kblur;
+    hd.threshold = threshold;
+    std::vector<unsigned char> data;
+    size_t tables = sizeof(hd) + hd.ndigits*sizeof(BankDigit);
+    data.resize(tables);
+    auto put = [&](const void *p, size_t n) {
+        data.resize((data.size() + 3) & ~size_t(3));
+        uint32_t offset = data.size();
+        data.insert(data.end(), (const unsigned char *)p, (const unsigned char *)p + n);
+        return offset;
+    };
+    auto patch = [&](const Patch& p) {
+        return BankPatch{p.x0, p.y0, p.w, p.h, put(p.data, size_t(p.w)*p.h)};
+    };
+    auto points = [&](const PointList& pl) {
+        return BankPoints{put(pl.p, pl.n*sizeof(Pixel)), uint32_t(pl.n)};
+    };
+    size_t pos = sizeof(hd);
+    for (auto& d : digits) {
+        BankDigit bd{d.x0, d.y0, d.x1, d.y1, patch(d.dt), patch(d.gray), points(d.pts)};
+        memcpy(&data[pos], &bd, sizeof(bd));
+        pos += sizeof(bd);
+    }
+    hd.size = data.size();
+    hd.crc = pngCRC(&data[sizeof(hd)], data.size() - sizeof(hd));
+    memcpy(&data[0], &hd, sizeof(hd));
+    return data;
+}
+
+#endif
@@ -0,0 +1,185 @@
+#if !defined(CACHE_H_INCLUDED)
+#define CACHE_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+// 128-bit content key
+struct CacheKey {
+    uint64_t a, b;
+    bool operator==(const CacheKey& o) const { return a == o.a && b == o.b; }
+};
+
+// Incremental hash of the bytes of values, two independent 64-bit lanes
+struct Hasher {
+    uint64_t a = 0x243F6A8885A308D3ull, b = 0x13198A2E03707344ull;
+
+    void word(uint64_t v) {
+        a = (a ^ v) * 0x9E3779B97F4A7C15ull;
+        a ^= a >> 29;
+        b = (b + v) * 0xC2B2AE3D27D4EB4Full;
+        b ^= b >> 31;
+    }
+
+    void bytes(const void *p, size_t n) {
+        const unsigned char *s = (const unsigned char *)p;
+        for (; n >= 8; s+=8, n-=8) {
+            uint64_t v;
+            memcpy(&v, s, 8);
+            word(v);
+        }
+        uint64_t v = n;
+        memcpy(&v, s, n);
+        word(v ^ (uint64_t(n) << 56));
+    }
+
+    template<typename T>
+    void add(const T& v) {
+        static_assert(std::is_trivially_copyable<T>::value, "plain data");
+        bytes(&v, sizeof(v));
+    }
+
+    CacheKey key() const {
+        uint64_t x = a ^ (b >> 17), y = b ^ (a << 13);
+        return CacheKey{x * 0xFF51AFD7ED558CCDull, y * 0xC4CEB9FE1A85EC53ull};
+    }
+};
+
+// Thread-safe least recently used cache of 'capacity' plain values. All
+// memory is allocated up front: entries are kept in a vector linked in
+// recency order and found through an open addressing table, so lookups and
+// insertions never allocate.
+template<typename V>
+struct LRUCache {
+    static_assert(std::is_trivially_copyable<V>::value, "plain data values");
+
+    struct Entry {
+        CacheKey key;
+        V value;
+        int prev, next;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<int> table;             // entry index, -1 when free
+    int head = -1, tail = -1;           // most and least recently used
+    int mask = 0;
+    std::mutex m;
+    std::atomic<long long> hits{0}, misses{0};
+
+    LRUCache(int capacity=0) { resize(capacity); }
+
+    int capacity() const { return entries.capacity(); }
+
+    void resize(int capacity) {
+        std::lock_guard<std::mutex> lock(m);
+        entries.clear();
+        entries.shrink_to_fit();
+        entries.reserve(capacity);
+        int n = 1;
+        while (n < 2*capacity) n *= 2;
+        table.assign(capacity ? n : 0, -1);
+        mask = n - 1;
+        head = tail = -1;
+    }
+
+    // Table slot of key, or the free slot where it would go
+    int slot(const CacheKey& key) const {
+        int i = key.a & mask;
+        while (table[i] >= 0 && !(entries[table[i]].key == key)) i = (i + 1) & mask;
+        return i;
+    }
+
+    void unlink(int e) {
+        Entry& x = entries[e];
+        (x.prev >= 0 ? entries[x.prev].next : head) = x.next;
+        (x.next >= 0 ? entries[x.next].prev : tail) = x.prev;
+    }
+
+    void push_front(int e) {
+        entries[e].prev = -1;
+        entries[e].next = head;
+        (head >= 0 ? entries[head].prev : tail) = e;
+        head = e;
+    }
+
+    // Removes the table slot i keeping the probe sequences unbroken
+    void erase_slot(int i) {
+        table[i] = -1;
+        for (int j = (i + 1) & mask; table[j] >= 0; j = (j + 1) & mask) {
+            int home = entries[table[j]].key.a & mask;
+            // Move back entries whose home isn't in (i, j]
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                table[i] = table[j];
+                table[j] = -1;
+                i = j;
+            }
+        }
+    }
+
+    bool get(const CacheKey& key, V& value) {
+        if (!capacity()) return false;
+        std::lock_guard<std::mutex> lock(m);
+        int e = table[slot(key)];
+        if (e < 0) {
+            misses++;
+            return false;
+        }
+        hits++;
+        unlink(e);
+        push_front(e);
+        value = entries[e].value;
+        return true;
+    }
+
+    void put(const CacheKey& key, const V& value) {
+        if (!capacity()) return;
+        std::lock_guard<std::mutex> lock(m);
+        int i = slot(key), e = table[i];
+        if (e >= 0) {
+            unlink(e);
+        } else if (int(entries.size()) < capacity()) {
+            e = entries.size();
+            entries.push_back(Entry{key, value, -1, -1});
+            table[i] = e;
+        } else {
+            e = tail;
+            unlink(e);
+            erase_slot(slot(entries[e].key));
+            entries[e].key = key;
+            table[slot(key)] = e;
+        }
+        entries[e].value = value;
+        push_front(e);
+    }
+
+    // Entries from the least to the most recently used, so that loading
+    // them with put() restores the order
+    void save(FILE *f) {
+        std::lock_guard<std::mutex> lock(m);
+        uint32_t n = entries.size();
+        fwrite(&n, sizeof(n), 1, f);
+        for (int e=tail; e>=0; e=entries[e].prev) {
+            fwrite(&entries[e].key, sizeof(CacheKey), 1, f);
+            fwrite(&entries[e].value, sizeof(V), 1, f);
+        }
+    }
+
+    bool load(FILE *f) {
+        uint32_t n;
+        if (fread(&n, sizeof(n), 1, f) != 1) return false;
+        for (uint32_t i=0; i<n; i++) {
+            CacheKey key;
+            V value;
+            if (fread(&key, sizeof(key), 1, f) != 1 || fread(&value, sizeof(value), 1, f) != 1) return false;
+            put(key, value);
+        }
+        return true;
+    }
+};
+
+#endif
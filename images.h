@@ -26,19 +26,54 @@ SOFTWARE.
 */
 
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <memory>
 #include <vector>
 #include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
 #include <string>
 #include <stdexcept>
+#include <algorithm>
+#include "arena.h"
 
 struct ImageError : std::runtime_error {
     ImageError(const char *what) : runtime_error(what) {}
 };
 
+// Largest decoded image, so that pixel counts and offsets fit in an int
+const long long MAX_PIXELS = 1 << 28;
+
+template<typename T>
+struct Image;
+
+// Read-only view of pixels stored elsewhere (an Image, a memory mapped
+// file...), rows 'stride' pixels apart
+template<typename T>
+struct ImageView {
+    int w = 0, h = 0, stride = 0;
+    const T *data = nullptr;
+
+    ImageView() {}
+    ImageView(const T *data, int w, int h, int stride) : w(w), h(h), stride(stride), data(data) {}
+    ImageView(const Image<T>& img);
+
+    T operator()(int x, int y) const {
+        return x>=0 && y>=0 && x<w && y<h ? data[size_t(y)*stride+x] : 0;
+    }
+
+    const T *row(int y) const { return data + size_t(y)*stride; }
+};
+
+// Pixels are scratch memory (see arena.h): images created while an arena
+// is current live in it
 template<typename T>
 struct Image {
     int w, h;
-    std::vector<T> data;
+    Scratch<T> data;
 
     Image(int w, int h) : w(w), h(h), data(w*h) {}
 
@@ -58,98 +93,1235 @@ struct Image {
         : w(other.w), h(other.h),
           data(other.data.begin(), other.data.end())
     { }
+
+    // Copy of the viewed pixels
+    explicit Image(const ImageView<T>& v) : w(v.w), h(v.h) {
+        data.reserve(size_t(w)*h);
+        for (int y=0; y<h; y++) data.insert(data.end(), v.row(y), v.row(y) + w);
+    }
 };
 
 template<typename T>
-Image<T> loadImage(const std::string& name);
+ImageView<T>::ImageView(const Image<T>& img) : w(img.w), h(img.h), stride(img.w), data(img.data.data()) {}
 
-template<>
-Image<unsigned char> loadImage<unsigned char>(const std::string& fname) {
-    struct F {
-        FILE *f;
-        bool convert;
-        F(const std::string& fname) {
-            if (fname.size() > 3 && fname.substr(fname.size()-4) == ".pgm") {
-                convert = false;
-                f = fopen(fname.c_str(), "rb");
-            } else {
-                convert = true;
-                f = popen(("convert " + fname + " pgm:-").c_str(), "r");
+// Integer pixel coordinates
+struct Pixel { int x, y; };
+
+// Connected set of pixels with its bounding box
+struct Blob {
+    Scratch<Pixel> pts;
+    int x0, y0, x1, y1, area;
+};
+
+// Rectangle of an image; parts outside the source are 0
+template<typename T>
+Image<T> crop(const ImageView<T>& img, int x0, int y0, int w, int h) {
+    Image<T> res(w, h);
+    for (int y=0; y<h; y++) {
+        for (int x=0; x<w; x++) res.data[y*w+x] = img(x0+x, y0+y);
+    }
+    return res;
+}
+
+template<typename T>
+Image<T> crop(const Image<T>& img, int x0, int y0, int w, int h) {
+    return crop(ImageView<T>(img), x0, y0, w, h);
+}
+
+// Half size image, each pixel the rounded mean of a 2x2 block (an odd last
+// row or column is dropped), so coarse pixel x covers source pixels 2x, 2x+1
+template<typename T>
+Image<T> halfSize(const ImageView<T>& img) {
+    Image<T> res(img.w/2, img.h/2);
+    for (int y=0; y<res.h; y++) {
+        const T *r0 = img.row(2*y), *r1 = img.row(2*y+1);
+        T *d = &res.data[size_t(y)*res.w];
+        for (int x=0; x<res.w; x++) {
+            d[x] = (r0[2*x] + r0[2*x+1] + r1[2*x] + r1[2*x+1] + 2) / 4;
+        }
+    }
+    return res;
+}
+
+// Image pyramid levels 1 to 'levels' (or until a side is 1), each half the
+// size of the previous one; level 0, the image itself, isn't copied
+template<typename T>
+Scratch<Image<T>> pyramid(const ImageView<T>& img, int levels) {
+    Scratch<Image<T>> res;
+    for (int i=0; i<levels && (i ? res.back().w : img.w) > 1 && (i ? res.back().h : img.h) > 1; i++) {
+        res.push_back(halfSize(i ? ImageView<T>(res.back()) : img));
+    }
+    return res;
+}
+
+inline std::vector<unsigned char> readFile(const std::string& fname) {
+    FILE *f = fopen(fname.c_str(), "rb");
+    if (!f) {
+        perror("readFile");
+        throw ImageError("Error opening image file");
+    }
+    std::vector<unsigned char> buf;
+    unsigned char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) buf.insert(buf.end(), chunk, chunk+n);
+    fclose(f);
+    return buf;
+}
+
+// Decoded image: 1 (gray) or 3 (RGB) interleaved 8-bit channels
+struct Pixels {
+    int w = 0, h = 0, channels = 0;
+    Scratch<unsigned char> data;
+};
+
+inline int gray(int r, int g, int b) { return (r*299 + g*587 + b*114 + 500) / 1000; }
+
+/////////////////////////////////////////////////////////////////////////////
+// JPEG (baseline and progressive huffman, 8-bit, 1 or 3 components)
+
+struct JPEGDecoder {
+    static const unsigned char *zigzag() {
+        static const unsigned char zz[64+16] = {
+             0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+            12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+            35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+            58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+            // extra entries so that corrupted run lengths can't overflow
+            63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63 };
+        return zz;
+    }
+
+    struct Huffman {
+        unsigned short fast[512];      // (length << 8) + value, 0 if longer than 9 bits
+        int maxcode[18], valptr[17], mincode[17];
+        unsigned char values[256];
+        bool defined = false;          // set by a DHT segment
+
+        // Until defined every code is invalid
+        Huffman() : fast(), valptr(), mincode(), values() { std::fill(maxcode, maxcode+18, -1); }
+    };
+
+    struct Component {
+        int id, h, v, tq, td, ta;
+        int bw, bh;                    // blocks per line / column (MCU padded)
+        int dcpred;
+        Scratch<short> coef;
+        Scratch<unsigned char> plane;
+    };
+
+    const unsigned char *p, *end;
+    unsigned long long acc = 0;
+    int nbits = 0;
+    bool marker = false;
+
+    unsigned short qt[4][64];
+    Huffman dc[4], ac[4];
+    Scratch<Component> comps;
+    int w = 0, h = 0, hmax = 1, vmax = 1, mcusx = 0, mcusy = 0;
+    bool progressive = false;
+    int restart = 0, eobrun = 0;
+
+    JPEGDecoder(const unsigned char *data, size_t size) : p(data), end(data + size) {}
+
+    int u8() {
+        if (p >= end) throw ImageError("Truncated JPEG file");
+        return *p++;
+    }
+    int u16() { int hi = u8(); return (hi << 8) + u8(); }
+
+    void fill() {
+        while (nbits <= 56) {
+            int b = 0;
+            if (!marker && p < end) {
+                b = *p;
+                if (b == 0xFF) {
+                    int b2 = p+1 < end ? p[1] : 0xD9;
+                    if (b2 == 0) p += 2; else { marker = true; b = 0; }
+                } else {
+                    p++;
+                }
             }
-            if (!f) {
-                perror("loadImage<unsigned char>");
-                throw ImageError("Error opening image file");
+            acc |= (unsigned long long)b << (56 - nbits);
+            nbits += 8;
+        }
+    }
+
+    int bits(int n) {
+        if (n == 0) return 0;
+        if (nbits < n) fill();
+        int v = int(acc >> (64 - n));
+        acc <<= n; nbits -= n;
+        return v;
+    }
+
+    int bit() { return bits(1); }
+
+    int extend(int v, int s) { return v < (1 << (s-1)) ? v - (1 << s) + 1 : v; }
+
+    int decode(const Huffman& hf) {
+        if (nbits < 16) fill();
+        int e = hf.fast[acc >> (64 - 9)];
+        if (e) {
+            acc <<= e >> 8; nbits -= e >> 8;
+            return e & 255;
+        }
+        for (int len=10; len<=16; len++) {
+            int code = int(acc >> (64 - len));
+            if (code <= hf.maxcode[len]) {
+                acc <<= len; nbits -= len;
+                return hf.values[hf.valptr[len] + code - hf.mincode[len]];
             }
         }
-        ~F() {
-            if (f) (convert ? pclose : fclose)(f);
+        throw ImageError("Invalid JPEG huffman code");
+    }
+
+    void resetBits() { acc = 0; nbits = 0; marker = false; }
+
+    void readDQT() {
+        int len = u16() - 2;
+        while (len > 0) {
+            int pq = u8(), tq = pq & 15; pq >>= 4;
+            if (tq > 3) throw ImageError("Invalid JPEG quantization table");
+            for (int i=0; i<64; i++) qt[tq][zigzag()[i]] = pq ? u16() : u8();
+            len -= 65 + 64*pq;
         }
-        operator FILE *() { return f; };
-    } f(fname);
+    }
 
-    int w, h;
-    if (fgetc(f) != 'P' || fgetc(f) != '5' || fgetc(f) != '\n') throw ImageError("Not a PGM file");
-    int c; while((c = fgetc(f)) == '#') {
-        while ((c = fgetc(f)) != EOF && c != '\n') ;
-    }
-    if (c != EOF) ungetc(c, f);
-    if (fscanf(f, "%i %i 255%*c", &w, &h)!=2 || w<0 || h<0) ImageError("Not a PGM file");
-    Image<unsigned char> img(w, h);
-    fread(&img[0], 1, w*h, f);
-    return img;
+    void readDHT() {
+        int len = u16() - 2;
+        while (len > 0) {
+            int tc = u8(), th = tc & 15; tc >>= 4;
+            if (th > 3 || tc > 1) throw ImageError("Invalid JPEG huffman table");
+            Huffman& hf = tc ? ac[th] : dc[th];
+            int counts[17], total = 0;
+            for (int i=1; i<=16; i++) total += counts[i] = u8();
+            if (total > 256) throw ImageError("Invalid JPEG huffman table");
+            for (int i=0; i<total; i++) hf.values[i] = u8();
+            std::fill(hf.fast, hf.fast+512, 0);
+            int code = 0, k = 0;
+            for (int l=1; l<=16; l++) {
+                hf.valptr[l] = k;
+                hf.mincode[l] = code;
+                // codes of length l must fit in l bits
+                if (code + counts[l] > (1 << l)) throw ImageError("Invalid JPEG huffman table");
+                for (int i=0; i<counts[l]; i++, k++, code++) {
+                    if (l <= 9) {
+                        for (int j=0; j<(1 << (9-l)); j++) {
+                            hf.fast[(code << (9-l)) + j] = (l << 8) + hf.values[k];
+                        }
+                    }
+                }
+                hf.maxcode[l] = counts[l] ? code-1 : -1;
+                code <<= 1;
+            }
+            hf.maxcode[17] = 0x7FFFFFFF;
+            hf.defined = true;
+            len -= 17 + total;
+        }
+    }
+
+    void readSOF() {
+        u16();
+        if (u8() != 8) throw ImageError("Unsupported JPEG precision");
+        h = u16(); w = u16();
+        int nf = u8();
+        if (w <= 0 || h <= 0 || (long long)w*h > MAX_PIXELS || (nf != 1 && nf != 3)) throw ImageError("Unsupported JPEG format");
+        comps.resize(nf);
+        for (auto& c : comps) {
+            c.id = u8();
+            int hv = u8();
+            c.h = hv >> 4; c.v = hv & 15;
+            c.tq = u8() & 3;
+            if (c.h < 1 || c.h > 4 || c.v < 1 || c.v > 4) throw ImageError("Invalid JPEG sampling factors");
+            hmax = std::max(hmax, c.h); vmax = std::max(vmax, c.v);
+        }
+        mcusx = (w + 8*hmax - 1) / (8*hmax);
+        mcusy = (h + 8*vmax - 1) / (8*vmax);
+        for (auto& c : comps) {
+            c.bw = mcusx * c.h;
+            c.bh = mcusy * c.v;
+            c.coef.assign(size_t(c.bw) * c.bh * 64, 0);
+        }
+    }
+
+    // Adds the DC difference of the next block to the prediction, kept in
+    // the coefficient range
+    void decodeDC(Component& c) {
+        int s = decode(dc[c.td]);
+        // 8-bit samples have DC differences of at most 11 bits
+        if (s > 11) throw ImageError("Invalid JPEG DC coefficient");
+        c.dcpred = std::max(-32768, std::min(32767, c.dcpred + (s ? extend(bits(s), s) : 0)));
+    }
+
+    void decodeBlock(Component& c, short *blk, int ss, int se, int ah, int al) {
+        const unsigned char *zz = zigzag();
+        if (!progressive) {
+            decodeDC(c);
+            blk[0] = c.dcpred;
+            for (int k=1; k<64; k++) {
+                int rs = decode(ac[c.ta]), r = rs >> 4, s = rs & 15;
+                if (s == 0) {
+                    if (r != 15) break;
+                    k += 15;
+                } else {
+                    k += r;
+                    blk[zz[k]] = extend(bits(s), s);
+                }
+            }
+        } else if (ss == 0) {
+            if (ah == 0) {
+                decodeDC(c);
+                blk[0] = c.dcpred * (1 << al);
+            } else if (bit()) {
+                blk[0] |= 1 << al;
+            }
+        } else if (ah == 0) {
+            if (eobrun) { eobrun--; return; }
+            for (int k=ss; k<=se; k++) {
+                int rs = decode(ac[c.ta]), r = rs >> 4, s = rs & 15;
+                if (s == 0) {
+                    if (r < 15) {
+                        eobrun = (1 << r) - 1 + bits(r);
+                        break;
+                    }
+                    k += 15;
+                } else {
+                    k += r;
+                    blk[zz[k]] = extend(bits(s), s) * (1 << al);
+                }
+            }
+        } else {
+            int p1 = 1 << al, m1 = -1 * (1 << al);
+            auto refine = [&](short& v) {
+                              if (bit() && (v & p1) == 0) v += v >= 0 ? p1 : m1;
+                          };
+            int k = ss;
+            if (eobrun == 0) {
+                for (; k<=se; k++) {
+                    int rs = decode(ac[c.ta]), r = rs >> 4, s = rs & 15, v = 0;
+                    if (s) {
+                        v = bit() ? p1 : m1;
+                    } else if (r != 15) {
+                        eobrun = (1 << r) + bits(r);
+                        break;
+                    }
+                    for (; k<=se; k++) {
+                        short& cf = blk[zz[k]];
+                        if (cf) {
+                            refine(cf);
+                        } else if (--r < 0) {
+                            break;
+                        }
+                    }
+                    if (v && k <= 63) blk[zz[k]] = v;
+                }
+            }
+            if (eobrun > 0) {
+                for (; k<=se; k++) {
+                    short& cf = blk[zz[k]];
+                    if (cf) refine(cf);
+                }
+                eobrun--;
+            }
+        }
+    }
+
+    void skipToMarker() {
+        if (marker) return;
+        while (p+1 < end && !(p[0] == 0xFF && p[1] != 0 && (p[1] < 0xD0 || p[1] > 0xD7))) p++;
+    }
+
+    void readSOS(const bool *wanted) {
+        int len = u16(), ns = u8();
+        if (ns < 1 || ns > int(comps.size()) || len != 6 + 2*ns) throw ImageError("Invalid JPEG scan");
+        Scratch<Component *> sc;
+        bool any = false;
+        for (int i=0; i<ns; i++) {
+            int id = u8(), t = u8();
+            Component *c = nullptr;
+            for (int j=0; j<int(comps.size()); j++) {
+                if (comps[j].id == id) { c = &comps[j]; any |= wanted[j]; }
+            }
+            if (!c) throw ImageError("Invalid JPEG scan component");
+            c->td = t >> 4; c->ta = t & 15;
+            if (c->td > 3 || c->ta > 3) throw ImageError("Invalid JPEG huffman table selector");
+            sc.push_back(c);
+        }
+        int ss = u8(), se = u8(), a = u8(), ah = a >> 4, al = a & 15;
+        if (!progressive) { ss = 0; se = 63; ah = al = 0; }
+        if (ss > se || se > 63) throw ImageError("Invalid JPEG spectral selection");
+        resetBits();
+        if (!any && progressive) {
+            // This scan only refines components we don't need
+            skipToMarker();
+            return;
+        }
+        // Tables the scan decodes with must have been defined
+        bool usesDC = !progressive || (ss == 0 && ah == 0), usesAC = !progressive || ss > 0;
+        for (auto c : sc) {
+            if ((usesDC && !dc[c->td].defined) || (usesAC && !ac[c->ta].defined)) {
+                throw ImageError("Undefined JPEG huffman table");
+            }
+        }
+        for (auto c : sc) c->dcpred = 0;
+        eobrun = 0;
+        short scratch[64];
+        int todo = restart, rstn = 0;
+        auto checkRestart = [&]() {
+                                if (restart && --todo == 0) {
+                                    // Expect RSTn marker
+                                    skipToMarker();
+                                    while (p+1 < end && !(p[0] == 0xFF && p[1] == 0xD0 + rstn)) p++;
+                                    p += 2;
+                                    rstn = (rstn + 1) & 7;
+                                    resetBits();
+                                    for (auto c : sc) c->dcpred = 0;
+                                    eobrun = 0;
+                                    todo = restart;
+                                }
+                            };
+        if (ns == 1) {
+            Component& c = *sc[0];
+            int cw = ((w*c.h + hmax - 1) / hmax + 7) / 8, ch = ((h*c.v + vmax - 1) / vmax + 7) / 8;
+            for (int by=0; by<ch; by++) {
+                for (int bx=0; bx<cw; bx++) {
+                    decodeBlock(c, &c.coef[(size_t(by)*c.bw + bx)*64], ss, se, ah, al);
+                    checkRestart();
+                }
+            }
+        } else {
+            for (int my=0; my<mcusy; my++) {
+                for (int mx=0; mx<mcusx; mx++) {
+                    for (auto c : sc) {
+                        bool keep = wanted[c - &comps[0]];
+                        for (int v=0; v<c->v; v++) {
+                            for (int u=0; u<c->h; u++) {
+                                short *blk = scratch;
+                                if (keep) {
+                                    blk = &c->coef[(size_t(my*c->v + v)*c->bw + mx*c->h + u)*64];
+                                } else {
+                                    std::fill(scratch, scratch+64, 0);
+                                }
+                                decodeBlock(*c, blk, ss, se, ah, al);
+                            }
+                        }
+                    }
+                    checkRestart();
+                }
+            }
+        }
+        skipToMarker();
+    }
+
+    void idct(Component& c) {
+        static float cs[8][8];
+        static bool init = [](){
+                               for (int x=0; x<8; x++) {
+                                   for (int u=0; u<8; u++) {
+                                       cs[x][u] = (u ? 0.5f : 0.5f/sqrtf(2.f)) * cosf((2*x+1)*u*float(M_PI)/16);
+                                   }
+                               }
+                               return true;
+                           }();
+        (void)init;
+        int pw = c.bw*8;
+        c.plane.resize(size_t(pw) * c.bh * 8);
+        const unsigned short *q = qt[c.tq];
+        for (int by=0; by<c.bh; by++) {
+            for (int bx=0; bx<c.bw; bx++) {
+                const short *blk = &c.coef[(size_t(by)*c.bw + bx)*64];
+                float tmp[64];
+                for (int v=0; v<8; v++) {
+                    float f[8];
+                    bool zero = true;
+                    for (int u=0; u<8; u++) {
+                        f[u] = blk[v*8+u] * float(q[v*8+u]);
+                        zero &= (u == 0 || f[u] == 0);
+                    }
+                    for (int x=0; x<8; x++) {
+                        float s = f[0]*cs[x][0];
+                        if (!zero) for (int u=1; u<8; u++) s += f[u]*cs[x][u];
+                        tmp[v*8+x] = s;
+                    }
+                }
+                unsigned char *out = &c.plane[size_t(by*8)*pw + bx*8];
+                for (int x=0; x<8; x++) {
+                    for (int y=0; y<8; y++) {
+                        float s = 0;
+                        for (int v=0; v<8; v++) s += tmp[v*8+x]*cs[y][v];
+                        out[y*pw + x] = std::max(0, std::min(255, int(lrintf(s + 128))));
+                    }
+                }
+            }
+        }
+    }
+
+    Pixels decodeAll(bool color) {
+        if (u8() != 0xFF || u8() != 0xD8) throw ImageError("Not a JPEG file");
+        bool wanted[3] = {true, color, color};
+        for (;;) {
+            while (p < end && *p != 0xFF) p++;
+            while (p < end && *p == 0xFF) p++;
+            int m = u8();
+            if (m == 0xD9) break;
+            if (m == 0xD8 || (m >= 0xD0 && m <= 0xD7) || m == 0x01) continue;
+            switch (m) {
+            case 0xC0: case 0xC1: case 0xC2:
+                progressive = m == 0xC2;
+                readSOF();
+                break;
+            case 0xC4: readDHT(); break;
+            case 0xDB: readDQT(); break;
+            case 0xDD: u16(); restart = u16(); break;
+            case 0xDA:
+                if (comps.empty()) throw ImageError("JPEG scan before frame header");
+                readSOS(wanted);
+                break;
+            default:
+                if ((m >= 0xC3 && m <= 0xCF) && m != 0xC8 && m != 0xCC) {
+                    throw ImageError("Unsupported JPEG encoding");
+                }
+                {
+                    int len = u16();
+                    if (end - p < len - 2) throw ImageError("Truncated JPEG file");
+                    p += len - 2;
+                }
+            }
+        }
+        if (comps.empty()) throw ImageError("JPEG without frame");
+        Pixels res;
+        res.w = w; res.h = h;
+        res.channels = color ? 3 : 1;
+        res.data.resize(size_t(w) * h * res.channels);
+        if (comps.size() == 1 || !color) {
+            Component& c = comps[0];
+            idct(c);
+            int pw = c.bw*8;
+            for (int y=0; y<h; y++) {
+                for (int x=0; x<w; x++) {
+                    int v = c.plane[size_t(y*c.v/vmax)*pw + x*c.h/hmax];
+                    for (int k=0; k<res.channels; k++) res.data[(size_t(y)*w + x)*res.channels + k] = v;
+                }
+            }
+        } else {
+            for (auto& c : comps) idct(c);
+            unsigned char *o = &res.data[0];
+            for (int y=0; y<h; y++) {
+                for (int x=0; x<w; x++) {
+                    int s[3];
+                    for (int k=0; k<3; k++) {
+                        Component& c = comps[k];
+                        s[k] = c.plane[size_t(y*c.v/vmax)*c.bw*8 + x*c.h/hmax];
+                    }
+                    float Y = s[0], cb = s[1]-128.f, cr = s[2]-128.f;
+                    *o++ = std::max(0, std::min(255, int(lrintf(Y + 1.402f*cr))));
+                    *o++ = std::max(0, std::min(255, int(lrintf(Y - 0.344136f*cb - 0.714136f*cr))));
+                    *o++ = std::max(0, std::min(255, int(lrintf(Y + 1.772f*cb))));
+                }
+            }
+        }
+        return res;
+    }
+};
+
+inline Pixels decodeJPEG(const unsigned char *data, size_t size, bool color) {
+    return JPEGDecoder(data, size).decodeAll(color);
 }
 
-template<>
-Image<unsigned> loadImage<unsigned>(const std::string& fname) {
-    struct F {
-        FILE *f;
-        bool convert;
-        F(const std::string& fname) {
-            if (fname.size() > 4 && fname.substr(fname.size()-4) == "ppm") {
-                convert = false;
-                f = fopen(fname.c_str(), "rb");
+/////////////////////////////////////////////////////////////////////////////
+// zlib / PNG
+
+inline const unsigned short *deflateLengthBase() {
+    static const unsigned short t[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                          35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    return t;
+}
+inline const unsigned char *deflateLengthExtra() {
+    static const unsigned char t[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                         3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    return t;
+}
+inline const unsigned short *deflateDistBase() {
+    static const unsigned short t[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                          257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                          8193, 12289, 16385, 24577 };
+    return t;
+}
+inline const unsigned char *deflateDistExtra() {
+    static const unsigned char t[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                         7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    return t;
+}
+
+struct Inflater {
+    struct Huffman {
+        short count[16], symbol[288];
+        void build(const unsigned char *lengths, int n) {
+            std::fill(count, count+16, 0);
+            for (int i=0; i<n; i++) count[lengths[i]]++;
+            short offs[16];
+            offs[1] = 0;
+            for (int l=1; l<15; l++) offs[l+1] = offs[l] + count[l];
+            for (int i=0; i<n; i++) if (lengths[i]) symbol[offs[lengths[i]]++] = i;
+        }
+    };
+
+    const unsigned char *p, *end;
+    unsigned bitbuf = 0;
+    int bitcnt = 0;
+    Scratch<unsigned char>& out;
+    size_t limit;                       // largest output accepted
+
+    Inflater(const unsigned char *p, const unsigned char *end, Scratch<unsigned char>& out, size_t limit)
+        : p(p), end(end), out(out), limit(limit) {}
+
+    void room(size_t n) {
+        if (n > limit - out.size()) throw ImageError("Deflate data larger than expected");
+    }
+
+    int bits(int n) {
+        while (bitcnt < n) {
+            if (p >= end) throw ImageError("Truncated deflate stream");
+            bitbuf |= unsigned(*p++) << bitcnt;
+            bitcnt += 8;
+        }
+        int v = bitbuf & ((1u << n) - 1);
+        bitbuf >>= n; bitcnt -= n;
+        return v;
+    }
+
+    int decode(const Huffman& h) {
+        int code = 0, first = 0, index = 0;
+        for (int len=1; len<16; len++) {
+            code |= bits(1);
+            int count = h.count[len];
+            if (code - count < first) return h.symbol[index + (code - first)];
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+        throw ImageError("Invalid deflate code");
+    }
+
+    void codes(const Huffman& lit, const Huffman& dist) {
+        for (;;) {
+            int s = decode(lit);
+            if (s < 256) {
+                room(1);
+                out.push_back(s);
+            } else if (s == 256) {
+                return;
             } else {
-                convert = true;
-                f = popen(("convert " + fname + " ppm:-").c_str(), "r");
-            }
-            if (!f) {
-                perror("loadImage<unsigned>");
-                throw ImageError("Error opening image file");
+                s -= 257;
+                if (s >= 29) throw ImageError("Invalid deflate length");
+                int len = deflateLengthBase()[s] + bits(deflateLengthExtra()[s]);
+                int d = decode(dist);
+                if (d >= 30) throw ImageError("Invalid deflate distance");
+                size_t dd = deflateDistBase()[d] + bits(deflateDistExtra()[d]);
+                if (dd > out.size()) throw ImageError("Invalid deflate distance");
+                size_t from = out.size() - dd;
+                room(len);
+                for (int i=0; i<len; i++) out.push_back(out[from+i]);
             }
         }
-        ~F() {
-            if (f) (convert ? pclose : fclose)(f);
+    }
+
+    void inflate() {
+        int last;
+        do {
+            last = bits(1);
+            int type = bits(2);
+            if (type == 0) {
+                bitbuf = 0; bitcnt = 0;
+                if (end - p < 4) throw ImageError("Truncated deflate stream");
+                int len = p[0] + (p[1] << 8);
+                p += 4;
+                if (end - p < len) throw ImageError("Truncated deflate stream");
+                room(len);
+                out.insert(out.end(), p, p+len);
+                p += len;
+            } else if (type == 1) {
+                static Huffman lit, dist;
+                static bool init = [](){
+                                       unsigned char l[288];
+                                       for (int i=0; i<288; i++) l[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+                                       lit.build(l, 288);
+                                       std::fill(l, l+30, 5);
+                                       dist.build(l, 30);
+                                       return true;
+                                   }();
+                (void)init;
+                codes(lit, dist);
+            } else if (type == 2) {
+                static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4,
+                                                         12, 3, 13, 2, 14, 1, 15 };
+                int nlen = bits(5) + 257, ndist = bits(5) + 1, ncode = bits(4) + 4;
+                unsigned char lengths[320] = {};
+                for (int i=0; i<ncode; i++) lengths[order[i]] = bits(3);
+                Huffman lencode, lit, dist;
+                lencode.build(lengths, 19);
+                int i = 0;
+                while (i < nlen + ndist) {
+                    int s = decode(lencode);
+                    if (s < 16) {
+                        lengths[i++] = s;
+                    } else {
+                        int len = 0, rep;
+                        if (s == 16) {
+                            if (i == 0) throw ImageError("Invalid deflate lengths");
+                            len = lengths[i-1];
+                            rep = 3 + bits(2);
+                        } else if (s == 17) {
+                            rep = 3 + bits(3);
+                        } else {
+                            rep = 11 + bits(7);
+                        }
+                        if (i + rep > nlen + ndist) throw ImageError("Invalid deflate lengths");
+                        while (rep--) lengths[i++] = len;
+                    }
+                }
+                lit.build(lengths, nlen);
+                dist.build(lengths + nlen, ndist);
+                codes(lit, dist);
+            } else {
+                throw ImageError("Invalid deflate block");
+            }
+        } while (!last);
+    }
+};
+
+// CRC-32 (as in PNG and zlib), eight bytes per step with slicing tables
+inline unsigned pngCRC(const unsigned char *p, size_t n, unsigned crc=0) {
+    static unsigned table[8][256];
+    static bool init = [](){
+                           for (unsigned i=0; i<256; i++) {
+                               unsigned c = i;
+                               for (int k=0; k<8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                               table[0][i] = c;
+                           }
+                           for (int k=1; k<8; k++) {
+                               for (int i=0; i<256; i++) {
+                                   table[k][i] = (table[k-1][i] >> 8) ^ table[0][table[k-1][i] & 255];
+                               }
+                           }
+                           return true;
+                       }();
+    (void)init;
+    crc = ~crc;
+    for (; n >= 8; p += 8, n -= 8) {
+        unsigned a = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | unsigned(p[3]) << 24);
+        crc = (table[7][a & 255] ^ table[6][(a >> 8) & 255] ^
+               table[5][(a >> 16) & 255] ^ table[4][a >> 24] ^
+               table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]]);
+    }
+    for (size_t i=0; i<n; i++) crc = table[0][(crc ^ p[i]) & 255] ^ (crc >> 8);
+    return ~crc;
+}
+
+inline Pixels decodePNG(const unsigned char *data, size_t size, bool color) {
+    static const unsigned char sig[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+    if (size < 8 || !std::equal(sig, sig+8, data)) throw ImageError("Not a PNG file");
+    auto be32 = [](const unsigned char *p) { return (unsigned(p[0])<<24) + (p[1]<<16) + (p[2]<<8) + p[3]; };
+    const unsigned char *p = data + 8, *end = data + size;
+    int w = 0, h = 0, depth = 0, type = 0, interlace = 0;
+    Scratch<unsigned char> idat, palette;
+    for (;;) {
+        if (end - p < 12) throw ImageError("Truncated PNG file");
+        unsigned len = be32(p);
+        if (len > unsigned(end - p - 12)) throw ImageError("Truncated PNG file");
+        std::string id(p+4, p+8);
+        const unsigned char *c = p + 8;
+        if (id == "IHDR") {
+            if (len < 13) throw ImageError("Invalid PNG header");
+            w = be32(c); h = be32(c+4); depth = c[8]; type = c[9]; interlace = c[12];
+            if (w <= 0 || h <= 0 || (long long)w*h > MAX_PIXELS || c[10] || c[11] || interlace > 1) {
+                throw ImageError("Unsupported PNG format");
+            }
+        } else if (id == "PLTE") {
+            palette.assign(c, c+len);
+        } else if (id == "IDAT") {
+            idat.insert(idat.end(), c, c+len);
+        } else if (id == "IEND") {
+            break;
         }
-        operator FILE *() { return f; };
-    } f(fname);
-    int w, h;
-    if (fgetc(f) != 'P' || fgetc(f) != '6' || fgetc(f) != '\n') throw ImageError("Not a PPM file");
-    int c; while((c = fgetc(f)) == '#') {
-        while ((c = fgetc(f)) != EOF && c != '\n') ;
-    }
-    if (c != EOF) ungetc(c, f);
-    if (fscanf(f, "%i %i 255%*c", &w, &h)!=2 || w<0 || h<0) throw ImageError("Not a PPM file");
-    Image<unsigned int> img(w, h);
-    std::vector<unsigned char> row(w*3);
+        p += len + 12;
+    }
+    static const int channels_of[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    if (type > 6 || channels_of[type] == 0 || (type == 3 && palette.empty()) ||
+        !(depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16) ||
+        ((type == 2 || type == 4 || type == 6) && depth < 8) || (type == 3 && depth > 8)) {
+        throw ImageError("Unsupported PNG format");
+    }
+    if (idat.size() < 2) throw ImageError("Invalid PNG data");
+    int nc = channels_of[type], bpp = std::max(1, nc*depth/8);
+    // Calls f(x0, y0, dx, dy) for the Adam7 passes or the whole image
+    auto passes = [&](auto f) {
+                      if (interlace) {
+                          f(0, 0, 8, 8); f(4, 0, 8, 8); f(0, 4, 4, 8); f(2, 0, 4, 4);
+                          f(0, 2, 2, 4); f(1, 0, 2, 2); f(0, 1, 1, 2);
+                      } else {
+                          f(0, 0, 1, 1);
+                      }
+                  };
+    // Filtered rows (filter byte and samples) of all the passes: inflating
+    // more than this is an error, so a small IDAT can't expand without bound
+    size_t expected = 0;
+    passes([&](int x0, int y0, int dx, int dy) {
+               size_t pw = (w - x0 + dx - 1) / dx, ph = (h - y0 + dy - 1) / dy;
+               if (pw && ph) expected += ph * (1 + (pw * nc * depth + 7) / 8);
+           });
+    Scratch<unsigned char> raw;
+    raw.reserve(expected);
+    Inflater(&idat[2], &idat[0] + idat.size(), raw, expected).inflate();
+
+    Pixels res;
+    res.w = w; res.h = h; res.channels = color ? 3 : 1;
+    res.data.resize(size_t(w) * h * res.channels);
+    size_t pos = 0;
+    auto pass = [&](int x0, int y0, int dx, int dy) {
+                    int pw = (w - x0 + dx - 1) / dx, ph = (h - y0 + dy - 1) / dy;
+                    if (pw <= 0 || ph <= 0) return;
+                    size_t stride = (size_t(pw) * nc * depth + 7) / 8;
+                    Scratch<unsigned char> prev(stride), cur(stride);
+                    for (int y=0; y<ph; y++) {
+                        if (pos + 1 + stride > raw.size()) throw ImageError("Truncated PNG data");
+                        int filter = raw[pos++];
+                        for (size_t i=0; i<stride; i++) {
+                            int a = i >= size_t(bpp) ? cur[i-bpp] : 0, b = prev[i], c = i >= size_t(bpp) ? prev[i-bpp] : 0;
+                            int x = raw[pos+i];
+                            switch (filter) {
+                            case 0: break;
+                            case 1: x += a; break;
+                            case 2: x += b; break;
+                            case 3: x += (a + b) >> 1; break;
+                            case 4: {
+                                int pp = a + b - c, pa = abs(pp - a), pb = abs(pp - b), pc = abs(pp - c);
+                                x += (pa <= pb && pa <= pc) ? a : pb <= pc ? b : c;
+                                break;
+                            }
+                            default: throw ImageError("Invalid PNG filter");
+                            }
+                            cur[i] = x;
+                        }
+                        pos += stride;
+                        for (int x=0; x<pw; x++) {
+                            auto sample = [&](int k) -> int {
+                                              if (depth == 8) return cur[x*nc + k];
+                                              if (depth == 16) return cur[(x*nc + k)*2];
+                                              int bitpos = x*depth, v = (cur[bitpos >> 3] >> (8 - depth - (bitpos & 7))) & ((1 << depth) - 1);
+                                              return type == 3 ? v : v * 255 / ((1 << depth) - 1);
+                                          };
+                            int r, g, b;
+                            if (type == 3) {
+                                size_t i = sample(0) * 3;
+                                if (i + 2 >= palette.size()) throw ImageError("Invalid PNG palette index");
+                                r = palette[i]; g = palette[i+1]; b = palette[i+2];
+                            } else if (nc <= 2) {
+                                r = g = b = sample(0);
+                            } else {
+                                r = sample(0); g = sample(1); b = sample(2);
+                            }
+                            unsigned char *o = &res.data[(size_t(y0 + y*dy)*w + x0 + x*dx)*res.channels];
+                            if (color) {
+                                o[0] = r; o[1] = g; o[2] = b;
+                            } else {
+                                o[0] = nc <= 2 ? r : gray(r, g, b);
+                            }
+                        }
+                        std::swap(prev, cur);
+                    }
+                };
+    passes(pass);
+    return res;
+}
+
+// PNG writer: fixed-huffman deflate with a single-probe LZ77 hash
+inline std::vector<unsigned char> encodePNG(const unsigned char *pixels, int w, int h, int channels) {
+    int stride = w*channels;
+    std::vector<unsigned char> filtered;
+    filtered.reserve(size_t(stride + 1) * h);
+    std::vector<unsigned char> best(stride), trial(stride);
     for (int y=0; y<h; y++) {
-        fread(&row[0], 1, w*3, f);
-        for (int x=0; x<w; x++) {
-            img[y*w+x] = row[x*3+2] + (row[x*3+1]<<8) + (row[x*3]<<16);
+        const unsigned char *cur = pixels + size_t(y)*stride, *prev = y ? cur - stride : nullptr;
+        long bestscore = -1;
+        int bestf = 0;
+        for (int f=0; f<5; f++) {
+            long score = 0;
+            for (int i=0; i<stride; i++) {
+                int a = i >= channels ? cur[i-channels] : 0, b = prev ? prev[i] : 0,
+                    c = prev && i >= channels ? prev[i-channels] : 0, pr = 0;
+                switch (f) {
+                case 1: pr = a; break;
+                case 2: pr = b; break;
+                case 3: pr = (a + b) >> 1; break;
+                case 4: {
+                    int pp = a + b - c, pa = abs(pp - a), pb = abs(pp - b), pc = abs(pp - c);
+                    pr = (pa <= pb && pa <= pc) ? a : pb <= pc ? b : c;
+                    break;
+                }
+                }
+                trial[i] = cur[i] - pr;
+                score += abs((signed char)trial[i]);
+            }
+            if (bestscore < 0 || score < bestscore) {
+                bestscore = score; bestf = f;
+                std::swap(best, trial);
+            }
+        }
+        filtered.push_back(bestf);
+        filtered.insert(filtered.end(), best.begin(), best.end());
+    }
+
+    std::vector<unsigned char> z{0x78, 0x01};
+    unsigned bitbuf = 0;
+    int bitcnt = 0;
+    auto put = [&](unsigned v, int n) {
+                   bitbuf |= v << bitcnt; bitcnt += n;
+                   while (bitcnt >= 8) { z.push_back(bitbuf & 255); bitbuf >>= 8; bitcnt -= 8; }
+               };
+    auto huff = [&](unsigned code, int n) {
+                    unsigned r = 0;
+                    for (int i=0; i<n; i++) r |= ((code >> i) & 1) << (n-1-i);
+                    put(r, n);
+                };
+    auto literal = [&](int s) {
+                       if (s < 144) huff(0x30 + s, 8);
+                       else if (s < 256) huff(0x190 + s - 144, 9);
+                       else if (s < 280) huff(s - 256, 7);
+                       else huff(0xC0 + s - 280, 8);
+                   };
+    put(1, 1); put(1, 2);
+    const int HBITS = 15, WINDOW = 32768;
+    std::vector<int> head(1 << HBITS, -1);
+    const unsigned char *d = filtered.data();
+    int n = int(filtered.size());
+    for (int i=0; i<n;) {
+        int len = 0, dist = 0;
+        if (i + 3 <= n) {
+            unsigned hsh = ((d[i] << 16) + (d[i+1] << 8) + d[i+2]) * 2654435761u >> (32 - HBITS);
+            int cand = head[hsh];
+            head[hsh] = i;
+            if (cand >= 0 && i - cand <= WINDOW) {
+                int m = 0;
+                while (m < 258 && i + m < n && d[cand+m] == d[i+m]) m++;
+                if (m >= 3) { len = m; dist = i - cand; }
+            }
+        }
+        if (len) {
+            int s = 0;
+            while (s < 28 && deflateLengthBase()[s+1] <= len) s++;
+            literal(257 + s);
+            put(len - deflateLengthBase()[s], deflateLengthExtra()[s]);
+            int ds = 0;
+            while (ds < 29 && deflateDistBase()[ds+1] <= dist) ds++;
+            huff(ds, 5);
+            put(dist - deflateDistBase()[ds], deflateDistExtra()[ds]);
+            i += len;
+        } else {
+            literal(d[i++]);
+        }
+    }
+    literal(256);
+    if (bitcnt) put(0, 8 - bitcnt);
+    unsigned a = 1, b = 0;
+    for (int i=0; i<n; i++) { a = (a + d[i]) % 65521; b = (b + a) % 65521; }
+    unsigned adler = (b << 16) | a;
+    for (int k=3; k>=0; k--) z.push_back(adler >> (k*8));
+
+    std::vector<unsigned char> png{0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+    auto chunk = [&](const char *id, const unsigned char *data, size_t len) {
+                     for (int k=3; k>=0; k--) png.push_back(len >> (k*8));
+                     size_t start = png.size();
+                     png.insert(png.end(), id, id+4);
+                     png.insert(png.end(), data, data+len);
+                     unsigned crc = pngCRC(&png[start], len + 4);
+                     for (int k=3; k>=0; k--) png.push_back(crc >> (k*8));
+                 };
+    unsigned char ihdr[13] = { (unsigned char)(w >> 24), (unsigned char)(w >> 16),
+                               (unsigned char)(w >> 8), (unsigned char)w,
+                               (unsigned char)(h >> 24), (unsigned char)(h >> 16),
+                               (unsigned char)(h >> 8), (unsigned char)h,
+                               8, (unsigned char)(channels == 3 ? 2 : 0), 0, 0, 0 };
+    chunk("IHDR", ihdr, 13);
+    chunk("IDAT", z.data(), z.size());
+    chunk("IEND", nullptr, 0);
+    return png;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// PNM
+
+// Binary PNM (P5 gray, P6 RGB) header. Whitespace and comments may appear
+// between the fields; the single whitespace byte after maxval ends the
+// header. Samples are 2 bytes (big endian) when maxval is above 255.
+struct PNMHeader {
+    int w, h, channels, maxval;
+    size_t offset;              // of the pixels
+};
+
+inline PNMHeader parsePNMHeader(const unsigned char *data, size_t size) {
+    const unsigned char *p = data, *end = data + size;
+    auto token = [&]() -> int {
+                     for (;;) {
+                         while (p < end && isspace(*p)) p++;
+                         if (p < end && *p == '#') {
+                             while (p < end && *p != '\n' && *p != '\r') p++;
+                         } else {
+                             break;
+                         }
+                     }
+                     if (p == end || !isdigit(*p)) throw ImageError("Invalid PNM header");
+                     long v = 0;
+                     while (p < end && isdigit(*p)) {
+                         v = v*10 + (*p++ - '0');
+                         if (v > (1 << 24)) throw ImageError("Invalid PNM header");
+                     }
+                     return int(v);
+                 };
+    if (size < 3 || data[0] != 'P' || (data[1] != '5' && data[1] != '6') ||
+        !(isspace(data[2]) || data[2] == '#')) throw ImageError("Not a PNM file");
+    PNMHeader hd;
+    hd.channels = data[1] == '5' ? 1 : 3;
+    p += 2;
+    hd.w = token(); hd.h = token(); hd.maxval = token();
+    if (p == end || !isspace(*p++) || hd.w <= 0 || hd.h <= 0 || hd.maxval <= 0 || hd.maxval > 65535) {
+        throw ImageError("Unsupported PNM file");
+    }
+    hd.offset = p - data;
+    if (size_t(end - p) / hd.channels / (hd.maxval > 255 ? 2 : 1) / hd.w < size_t(hd.h)) throw ImageError("Truncated PNM file");
+    return hd;
+}
+
+// Reads one binary PNM file (header and pixels) from a stream of
+// concatenated ones into buf; false at the end of the stream
+inline bool readPNM(FILE *f, Scratch<unsigned char>& buf) {
+    buf.clear();
+    int c;
+    while ((c = getc(f)) != EOF && isspace(c)) { }
+    if (c == EOF) return false;
+    // Magic and three numbers; the whitespace byte after the last ends the header
+    long v[4] = {0, 0, 0, 0};
+    int field = 0;
+    bool in_field = true, comment = false;
+    buf.push_back(c);
+    while (field < 4) {
+        if ((c = getc(f)) == EOF || buf.size() > 1024) throw ImageError("Truncated PNM stream");
+        buf.push_back(c);
+        if (comment) {
+            comment = c != '\n' && c != '\r';
+        } else if (c == '#') {
+            comment = true;
+        } else if (isspace(c)) {
+            field += in_field;
+            in_field = false;
+        } else {
+            in_field = true;
+            if (field && isdigit(c) && v[field] <= (1 << 24)) v[field] = v[field]*10 + c - '0';
+        }
+    }
+    if (v[1] <= 0 || v[2] <= 0 || (long long)v[1] * v[2] > MAX_PIXELS) throw ImageError("Unsupported PNM file");
+    size_t n = size_t(v[1]) * v[2] * (buf[1] == '6' ? 3 : 1) * (v[3] > 255 ? 2 : 1), hd = buf.size();
+    buf.resize(hd + n);
+    if (fread(&buf[hd], 1, n, f) != n) throw ImageError("Truncated PNM stream");
+    return true;
+}
+
+inline Pixels decodePNM(const unsigned char *data, size_t size, bool color) {
+    PNMHeader hd = parsePNMHeader(data, size);
+    const unsigned char *p = data + hd.offset;
+    int nc = hd.channels, w = hd.w, h = hd.h;
+    Pixels res;
+    res.w = w; res.h = h; res.channels = color ? 3 : 1;
+    Scratch<unsigned char> px;
+    if (hd.maxval != 255) {
+        // Samples rescaled to 8 bits
+        px.resize(size_t(w) * h * nc);
+        int m = hd.maxval;
+        for (size_t i=0; i<px.size(); i++) {
+            int v = m > 255 ? (p[2*i] << 8) + p[2*i+1] : p[i];
+            px[i] = (std::min(v, m)*255 + m/2) / m;
+        }
+        p = px.data();
+    }
+    if (nc == res.channels) {
+        res.data.assign(p, p + size_t(w) * h * nc);
+    } else {
+        res.data.resize(size_t(w) * h * res.channels);
+        for (size_t i=0, n=size_t(w)*h; i<n; i++) {
+            if (color) {
+                res.data[i*3] = res.data[i*3+1] = res.data[i*3+2] = p[i];
+            } else {
+                res.data[i] = gray(p[i*3], p[i*3+1], p[i*3+2]);
+            }
         }
     }
+    return res;
+}
+
+inline bool knownImageFormat(const unsigned char *data, size_t size) {
+    return ((size >= 2 && data[0] == 'P' && (data[1] == '5' || data[1] == '6')) ||
+            (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF) ||
+            (size >= 8 && data[0] == 0x89 && data[1] == 'P' && data[2] == 'N' && data[3] == 'G'));
+}
+
+inline Pixels decodePixels(const unsigned char *data, size_t size, bool color) {
+    if (size >= 2 && data[0] == 'P') return decodePNM(data, size, color);
+    if (size >= 2 && data[0] == 0xFF && data[1] == 0xD8) return decodeJPEG(data, size, color);
+    if (size >= 8 && data[0] == 0x89) return decodePNG(data, size, color);
+    throw ImageError("Unsupported image format");
+}
+
+// Read-only memory mapping of a whole file; data is null when the file
+// can't be mapped (missing, empty, not a regular file...)
+struct MappedFile {
+    std::shared_ptr<const unsigned char> data;
+    size_t size = 0;
+};
+
+inline MappedFile mapFile(const std::string& fname) {
+    MappedFile res;
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) return res;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t size = st.st_size;
+        void *m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (m != MAP_FAILED) {
+            // control block on the heap: the mapping may outlive the current arena
+            res.data.reset((const unsigned char *)m, [size](const unsigned char *p){ munmap((void *)p, size); });
+            res.size = size;
+        }
+    }
+    close(fd);
+    return res;
+}
+
+// Reads an image file, decoding PNM, JPEG and PNG in-process (from a memory
+// mapping when possible) and using imagemagick `convert` only for other
+// formats
+inline Pixels loadPixels(const std::string& fname, bool color) {
+    MappedFile m = mapFile(fname);
+    std::vector<unsigned char> buf;
+    if (!m.data) buf = readFile(fname);
+    const unsigned char *data = m.data ? m.data.get() : buf.data();
+    size_t size = m.data ? m.size : buf.size();
+    if (knownImageFormat(data, size)) return decodePixels(data, size, color);
+    FILE *f = popen(("convert " + fname + (color ? " ppm:-" : " pgm:-")).c_str(), "r");
+    if (!f) {
+        perror("loadPixels");
+        throw ImageError("Error opening image file");
+    }
+    buf.clear();
+    unsigned char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) buf.insert(buf.end(), chunk, chunk+n);
+    pclose(f);
+    return decodePixels(buf.data(), buf.size(), color);
+}
+
+template<typename T>
+Image<T> decodeImage(const unsigned char *data, size_t size);
+
+template<typename T>
+Image<T> loadImage(const std::string& name);
+
+inline Image<unsigned char> grayImage(const Pixels& px) {
+    Image<unsigned char> img(px.w, px.h);
+    std::copy(px.data.begin(), px.data.end(), img.data.begin());
+    return img;
+}
+
+inline Image<unsigned> colorImage(const Pixels& px) {
+    Image<unsigned> img(px.w, px.h);
+    for (int i=0; i<px.w*px.h; i++) {
+        img[i] = (px.data[i*3]<<16) + (px.data[i*3+1]<<8) + px.data[i*3+2];
+    }
     return img;
 }
 
+template<>
+Image<unsigned char> decodeImage<unsigned char>(const unsigned char *data, size_t size) {
+    return grayImage(decodePixels(data, size, false));
+}
+
+template<>
+Image<unsigned> decodeImage<unsigned>(const unsigned char *data, size_t size) {
+    return colorImage(decodePixels(data, size, true));
+}
+
+template<>
+Image<unsigned char> loadImage<unsigned char>(const std::string& fname) {
+    return grayImage(loadPixels(fname, false));
+}
+
+template<>
+Image<unsigned> loadImage<unsigned>(const std::string& fname) {
+    return colorImage(loadPixels(fname, true));
+}
+
+// Gray image of a file. Binary 8-bit PGM files are memory mapped and
+// viewed in place, without copying or converting the pixels; other formats
+// are decoded into 'decoded'. Not copyable, as the view may point into it.
+struct MappedImage {
+    MappedFile file;
+    Image<unsigned char> decoded{0, 0};
+    ImageView<unsigned char> view;
+
+    MappedImage() {}
+    MappedImage(const MappedImage&) = delete;
+    MappedImage(MappedImage&&) = default;
+    MappedImage& operator=(MappedImage&&) = default;
+};
+
+inline MappedImage mapImage(const std::string& fname) {
+    MappedImage res;
+    res.file = mapFile(fname);
+    const unsigned char *data = res.file.data.get();
+    if (data && res.file.size >= 2 && data[0] == 'P' && data[1] == '5') {
+        PNMHeader hd = parsePNMHeader(data, res.file.size);
+        if (hd.maxval == 255) {
+            res.view = ImageView<unsigned char>(data + hd.offset, hd.w, hd.h, hd.w);
+            return res;
+        }
+    }
+    if (data && knownImageFormat(data, res.file.size)) {
+        res.decoded = grayImage(decodePixels(data, res.file.size, false));
+    } else {
+        res.decoded = loadImage<unsigned char>(fname);
+    }
+    res.file = MappedFile();
+    res.view = res.decoded;
+    return res;
+}
+
+inline bool hasExtension(const std::string& fname, const std::string& ext) {
+    return fname.size() > ext.size() && fname.substr(fname.size() - ext.size()) == ext;
+}
+
+inline void writeFile(const std::string& fname, const std::vector<unsigned char>& data) {
+    FILE *f = fopen(fname.c_str(), "wb");
+    if (!f || fwrite(data.data(), 1, data.size(), f) != data.size()) {
+        perror("writeFile");
+        if (f) fclose(f);
+        throw ImageError("Error saving image");
+    }
+    fclose(f);
+}
+
 template<typename T>
 void saveImage(const Image<T>& img, const std::string& filename);
 
 template<>
 void saveImage<unsigned char>(const Image<unsigned char>& img, const std::string& fname) {
+    if (hasExtension(fname, ".png")) {
+        writeFile(fname, encodePNG(&img.data[0], img.w, img.h, 1));
+        return;
+    }
     struct F {
         FILE *f;
         bool convert;
         F(const std::string& fname) {
-            if (fname.size() && fname.substr(fname.size()-4) == ".pgm") {
+            if (hasExtension(fname, ".pgm")) {
                 convert = false;
                 f = fopen(fname.c_str(), "wb");
             } else {
@@ -172,11 +1344,27 @@ void saveImage<unsigned char>(const Image<unsigned char>& img, const std::string
 
 template<>
 void saveImage<unsigned>(const Image<unsigned>& img, const std::string& fname) {
+    // RGB bytes of rows [y0, y1)
+    std::vector<unsigned char> rgb;
+    auto pack = [&](int y0, int y1) {
+                    rgb.resize(size_t(img.w)*(y1 - y0)*3);
+                    const unsigned *src = &img.data[size_t(y0)*img.w];
+                    for (size_t i=0, n=size_t(img.w)*(y1 - y0); i<n; i++) {
+                        rgb[i*3] = (src[i]>>16) & 255;
+                        rgb[i*3+1] = (src[i]>>8) & 255;
+                        rgb[i*3+2] = src[i] & 255;
+                    }
+                };
+    if (hasExtension(fname, ".png")) {
+        pack(0, img.h);
+        writeFile(fname, encodePNG(rgb.data(), img.w, img.h, 3));
+        return;
+    }
     struct F {
         FILE *f;
         bool convert;
         F(const std::string& fname) {
-            if (fname.size()>4 && fname.substr(fname.size()-4) == ".ppm") {
+            if (hasExtension(fname, ".ppm")) {
                 convert = false;
                 f = fopen(fname.c_str(), "wb");
             } else {
@@ -194,15 +1382,11 @@ void saveImage<unsigned>(const Image<unsigned>& img, const std::string& fname) {
         operator FILE *() { return f; };
     } f(fname);
 
+    // Streamed in bands of rows instead of converting the whole image first
     fprintf(f, "P6\n%i %i 255\n", img.w, img.h);
-    std::vector<unsigned char> row(img.w*3);
-    for (int y=0; y<img.h; y++) {
-        for (int x=0; x<img.w; x++) {
-            row[x*3] = (img[y*img.w+x]>>16) & 255;
-            row[x*3+1] = (img[y*img.w+x]>>8) & 255;
-            row[x*3+2] = img[y*img.w+x] & 255;
-        }
-        fwrite(&row[0], 1, img.w*3, f);
+    for (int y=0; y<img.h; y+=64) {
+        pack(y, std::min(img.h, y + 64));
+        fwrite(rgb.data(), 1, rgb.size(), f);
     }
 }
 
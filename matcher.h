@@ -0,0 +1,321 @@
+#if !defined(MATCHER_H_INCLUDED)
+#define MATCHER_H_INCLUDED
+
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "images.h"
+#include "bank.h"
+#include "cache.h"
+#include "profile.h"
+#include "simd.h"
+#include "threads.h"
+
+// Sum of base[off[i]] for i < n. The sum is checked every 64 terms and
+// returned as soon as it exceeds limit, as the caller then only needs to
+// know that it's too large.
+template<typename T>
+long long gatherSum(const T *base, const int *off, int n, long long limit) {
+    long long sum = 0;
+    for (int i=0; i<n; ) {
+        int e = std::min(n, i + 64);
+        for (; i<e; i++) sum += base[off[i]];
+        if (sum > limit) break;
+    }
+    return sum;
+}
+
+#if defined(SIMD_X86)
+// 32-bit gathers of 8 or 16-bit pixels, masked
+template<typename T>
+SIMD_TARGET("avx2")
+long long gatherSumAVX2(const T *base, const int *off, int n, long long limit) {
+    static_assert(sizeof(T) <= 2, "8 or 16-bit pixels");
+    long long sum = 0;
+    const __m256i bytes = _mm256_set1_epi32(sizeof(T) == 1 ? 0xFF : 0xFFFF);
+    int i = 0;
+    while (i + 8 <= n) {
+        __m256i acc = _mm256_setzero_si256();
+        for (int e=std::min(n & ~7, i + 64); i<e; i+=8) {
+            __m256i idx = _mm256_loadu_si256((const __m256i *)(off + i));
+            acc = _mm256_add_epi32(acc, _mm256_and_si256(_mm256_i32gather_epi32((const int *)base, idx, sizeof(T)), bytes));
+        }
+        __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+        sum += _mm_cvtsi128_si32(s);
+        if (sum > limit) return sum;
+    }
+    return sum + gatherSum(base, off + i, n - i, limit - sum);
+}
+#endif
+
+// Distance-transformed image with a border of 'pad' pixels valued 0 (as
+// Image reads outside), so lookups near the edges need no checks. Rows are
+// 'stride' pixels and 4 extra pixels at the end let 32-bit gathers read the
+// last one.
+template<typename T>
+struct PaddedImage {
+    int w = 0, h = 0, pad = 0, stride = 0;
+    Scratch<T> data;
+
+    PaddedImage() {}
+    PaddedImage(const Image<T>& img, int pad)
+        : w(img.w), h(img.h), pad(pad), stride(img.w + 2*pad),
+          data(size_t(stride)*(img.h + 2*pad) + 4)
+    {
+        for (int y=0; y<h; y++) {
+            std::copy(&img.data[size_t(y)*w], &img.data[size_t(y)*w] + w, &data[size_t(y+pad)*stride + pad]);
+        }
+    }
+
+    const T *at(int x, int y) const { return &data[size_t(y+pad)*stride + x+pad]; }
+};
+
+struct Match {
+    int digit;                  // -1 when nothing is below the error limit
+    double err;
+    int tx, ty;                 // template displacement
+};
+
+// Chamfer matching of candidate blobs of the rectified distance-transformed
+// image against the reference digits. The error of a digit is the mean of
+// the template distance at the candidate pixels and of the candidate
+// distance at the template pixels, with the template scaled to the
+// candidate height, centered on it and moved by up to one pixel.
+//
+// For each candidate height the templates are resampled once (and kept for
+// later images) to square buffers of side B in the candidate pixel grid,
+// where every pixel is an offset from the center, so a candidate needs its
+// pixel offsets computed once for all digits and displacements and every
+// lookup is a plain indexed byte read. Template pixels are kept as offsets
+// in the padded candidate image.
+//
+// Results are cached by the content of everything the match reads: the
+// candidate pixels relative to its center and the distances in the window
+// around it, so a cell seen before (a reprinted puzzle, a still video frame)
+// costs a hash instead of the matching loop.
+struct ChamferMatcher {
+    struct Scaled {
+        std::vector<unsigned char> dt;      // B*B + 4, center at (B/2, B/2)
+        std::vector<int> pts;               // offsets from the center in PaddedImage
+        std::vector<Pixel> xy;              // same as (x, y)
+    };
+    typedef std::array<Scaled, 9> Templates;
+
+    TemplateBank bank;
+    int sz, B, pad, stride;
+    mutable std::mutex m;
+    mutable std::map<int, std::unique_ptr<Templates>> cache;
+    mutable LRUCache<Match> cells;
+    std::unique_ptr<ThreadPool> workers;       // helpers of match(), null when serial
+
+    // sz is the rectified cell size: candidates are smaller than a cell and
+    // the rectified image is 11 cells wide
+    ChamferMatcher(const TemplateBank& bank, int sz)
+        : bank(bank), sz(sz), B(sz + 8), pad(B/2), stride(11*sz + 2*pad)
+    { }
+
+    template<typename T>
+    PaddedImage<T> pad_image(const Image<T>& img) const { return PaddedImage<T>(img, pad); }
+
+    const Templates& templates(int h) const {
+        std::lock_guard<std::mutex> lock(m);
+        auto& t = cache[h];
+        if (!t) {
+            t.reset(new Templates);
+            for (int d=0; d<9; d++) (*t)[d] = scale(bank.digits[d], h);
+        }
+        return *t;
+    }
+
+    // Identifies the bank and cell size cached matches are valid for
+    CacheKey context() const {
+        Hasher hs;
+        hs.bytes(bank.mem.get(), std::min(bank.size, sizeof(BankHeader)));
+        hs.add(bank.size);
+        hs.add(sz);
+        return hs.key();
+    }
+
+    template<typename T>
+    CacheKey cellKey(const PaddedImage<T>& img, const Blob& cand, double maxerr) const {
+        int cx = (cand.x0 + cand.x1) >> 1, cy = (cand.y0 + cand.y1) >> 1, c = B/2;
+        Hasher hs;
+        hs.add(int(sizeof(T)));
+        hs.add(maxerr);
+        int box[4] = {cand.x0 - cx, cand.y0 - cy, cand.x1 - cx, cand.y1 - cy};
+        hs.add(box);
+        for (auto& p : cand.pts) hs.word(uint64_t(uint32_t(p.x - cx)) << 32 | uint32_t(p.y - cy));
+        // template pixels are within c-2 of the center, displacements 1
+        for (int y=cy-c+1; y<cy+c; y++) hs.bytes(img.at(cx-c+1, y), (2*c-1)*sizeof(T));
+        return hs.key();
+    }
+
+    Scaled scale(const DigitTemplate& dd, int h) const {
+        Scaled s;
+        double sf = double(dd.y1 - dd.y0) / h;
+        double cx = (dd.x0 + dd.x1)*0.5, cy = (dd.y0 + dd.y1)*0.5;
+        int c = B/2;
+        s.dt.resize(size_t(B)*B + 4);
+        std::vector<int> col(B);
+        for (int x=0; x<B; x++) col[x] = int(floor(cx + (x - c + 0.5)*sf));
+        for (int y=0; y<B; y++) {
+            int ty = int(floor(cy + (y - c + 0.5)*sf));
+            for (int x=0; x<B; x++) s.dt[y*B + x] = dd.dt(col[x], ty);
+        }
+        for (auto& p : dd.pts) {
+            int x = int(floor((p.x + 0.5 - cx) / sf)), y = int(floor((p.y + 0.5 - cy) / sf));
+            x = std::max(2-c, std::min(c-2, x));
+            y = std::max(2-c, std::min(c-2, y));
+            s.xy.push_back(Pixel{x, y});
+            s.pts.push_back(y*stride + x);
+        }
+        return s;
+    }
+
+    // Offsets of the candidate pixels in the template buffers, from element
+    // B+1 so that the base of every displacement is within the buffer
+    // (pixels are at least 2 rows and columns from its edges)
+    Scratch<int> offsets(const Blob& cand) const {
+        int cx = (cand.x0 + cand.x1) >> 1, cy = (cand.y0 + cand.y1) >> 1;
+        Scratch<int> off;
+        off.reserve(cand.pts.size());
+        for (auto& p : cand.pts) {
+            int x = std::max(2, std::min(B-3, p.x - cx + B/2)),
+                y = std::max(2, std::min(B-3, p.y - cy + B/2));
+            off.push_back(y*B + x - (B + 1));
+        }
+        return off;
+    }
+
+    // Best displacement of template d for a candidate with pixel offsets
+    // off, digit -1 when no error is below maxerr
+    template<typename T>
+    Match matchDigit(const PaddedImage<T>& img, const Blob& cand, const Scratch<int>& off,
+                     const Templates& tpl, int d, double maxerr) const {
+        auto tsum = gatherSum<unsigned char>;
+        auto isum = gatherSum<T>;
+#if defined(SIMD_X86)
+        if (simd_level() == SIMD_AVX2) {
+            tsum = gatherSumAVX2<unsigned char>;
+            isum = gatherSumAVX2<T>;
+        }
+#endif
+        static const int shifts[9][2] = {{0, 0}, {-1, 0}, {1, 0}, {0, -1}, {0, 1},
+                                         {-1, -1}, {1, -1}, {-1, 1}, {1, 1}};
+        int cx = (cand.x0 + cand.x1) >> 1, cy = (cand.y0 + cand.y1) >> 1;
+        Match best{-1, maxerr, 0, 0};
+        const Scaled& s = tpl[d];
+        const int *tp = &s.pts[0];
+        Scratch<int> pts;
+        if (img.stride != stride) {
+            for (auto& p : s.xy) pts.push_back(p.y*img.stride + p.x);
+            tp = &pts[0];
+        }
+        int n = off.size() + s.pts.size();
+        for (auto& t : shifts) {
+            int tx = t[0], ty = t[1];
+            long long limit = (long long)(best.err * n);
+            long long e = tsum(&s.dt[B + 1 - (ty*B + tx)], &off[0], off.size(), limit);
+            if (e > limit) continue;
+            e += isum(img.at(cx + tx, cy + ty), tp, s.pts.size(), limit - e);
+            if (e > limit) continue;
+            double err = double(e) / n;
+            if (err < best.err) best = Match{d, err, tx, ty};
+        }
+        return best;
+    }
+
+    // Cached match of a candidate, false on a miss (with the key to store
+    // its match under)
+    template<typename T>
+    bool cached(const PaddedImage<T>& img, const Blob& cand, double maxerr, CacheKey& key, Match& m) const {
+        if (!cells.capacity()) return false;
+        key = cellKey(img, cand, maxerr);
+        if (cells.get(key, m)) {
+            profileCount("cell_hits", 1);
+            return true;
+        }
+        profileCount("cell_misses", 1);
+        return false;
+    }
+
+    // Best digit for a candidate blob of img (already padded, 8 or 16-bit
+    // distances); digits with an error of maxerr or more aren't considered.
+    // Each digit is only searched for errors below the best one so far.
+    template<typename T>
+    Match match(const PaddedImage<T>& img, const Blob& cand, double maxerr) const {
+        CacheKey key{0, 0};
+        Match best{-1, maxerr, 0, 0};
+        if (cached(img, cand, maxerr, key, best)) return best;
+        const Templates& tpl = templates(cand.y1 - cand.y0);
+        Scratch<int> off = offsets(cand);
+        for (int d=0; d<9; d++) {
+            Match m = matchDigit(img, cand, off, tpl, d, best.err);
+            if (m.digit >= 0) best = m;
+        }
+        cells.put(key, best);
+        return best;
+    }
+
+    // Helpers of match() for the candidates of one image, when started
+    void startWorkers(int threads) {
+        threads = default_threads(threads);
+        if (threads > 1) workers.reset(new ThreadPool(threads - 1));
+    }
+
+    // Pool tasks match with scratch memory from their own arena
+    struct WorkerScope : ArenaScope {
+        WorkerScope() : ArenaScope(&worker_arena()) {}
+    };
+
+    // match() of n candidates into res. Candidates missing from the cache
+    // are matched one at a time by the calling thread and the workers (when
+    // started), each as match() does, so the results don't depend on the
+    // scheduling. Cache lookups and updates stay on the calling thread.
+    template<typename T>
+    void match(const PaddedImage<T>& img, const Blob *cands, int n, double maxerr, Match *res) const {
+        if (!workers || n <= 1) {
+            for (int i=0; i<n; i++) res[i] = match(img, cands[i], maxerr);
+            return;
+        }
+        struct Todo {
+            int i;
+            CacheKey key;
+            const Templates *tpl;
+            Scratch<int> off;
+        };
+        Scratch<Todo> todo;
+        todo.reserve(n);
+        for (int i=0; i<n; i++) {
+            CacheKey key{0, 0};
+            res[i] = Match{-1, maxerr, 0, 0};
+            if (!cached(img, cands[i], maxerr, key, res[i])) {
+                todo.push_back(Todo{i, key, &templates(cands[i].y1 - cands[i].y0), offsets(cands[i])});
+            }
+        }
+        parallel_for<WorkerScope>(*workers, todo.size(), [&](int j) {
+                                      const Todo& t = todo[j];
+                                      Match& best = res[t.i];
+                                      for (int d=0; d<9; d++) {
+                                          Match m = matchDigit(img, cands[t.i], t.off, *t.tpl, d, best.err);
+                                          if (m.digit >= 0) best = m;
+                                      }
+                                  });
+        for (auto& t : todo) cells.put(t.key, res[t.i]);
+    }
+
+    // Error of every digit for a candidate, maxerr when not below it: the
+    // alternatives to its best match when the recognized grid is wrong
+    template<typename T>
+    void digitErrors(const PaddedImage<T>& img, const Blob& cand, double maxerr, double *err) const {
+        const Templates& tpl = templates(cand.y1 - cand.y0);
+        Scratch<int> off = offsets(cand);
+        for (int d=0; d<9; d++) err[d] = matchDigit(img, cand, off, tpl, d, maxerr).err;
+    }
+};
+
+#endif
@@ -0,0 +1,140 @@
+#if !defined(PROFILE_H_INCLUDED)
+#define PROFILE_H_INCLUDED
+
+#include <chrono>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Stage timings and counters of one run (or a sum of runs). Stage times are
+// self times: while a nested stage runs the enclosing one isn't charged, so
+// stage times add up to the profiled total.
+struct Profile {
+    std::vector<std::pair<std::string, double>> stages;         // seconds, in first use order
+    std::vector<std::pair<std::string, long long>> counters;
+    double seconds = 0;
+    int runs = 0;
+
+    // Room for the usual stages and counters, so that profiling an image
+    // doesn't allocate
+    Profile() {
+        stages.reserve(32);
+        counters.reserve(32);
+    }
+
+    template<typename V>
+    static V& slot(std::vector<std::pair<std::string, V>>& v, const std::string& name) {
+        for (auto& i : v) {
+            if (i.first == name) return i.second;
+        }
+        v.emplace_back(name, V());
+        return v.back().second;
+    }
+
+    void time(const char *name, double s) { slot(stages, name) += s; }
+    void count(const char *name, long long n) { slot(counters, name) += n; }
+
+    void add(const Profile& other) {
+        for (auto& i : other.stages) slot(stages, i.first) += i.second;
+        for (auto& i : other.counters) slot(counters, i.first) += i.second;
+        seconds += other.seconds;
+        runs += other.runs;
+    }
+
+    // JSON object members (without braces) for seconds, stages and counters
+    std::string json() const {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "\"seconds\": %.6f, \"stages\": {", seconds);
+        std::string res = buf;
+        for (size_t i=0; i<stages.size(); i++) {
+            snprintf(buf, sizeof(buf), "%s\"%s\": %.6f", i ? ", " : "", stages[i].first.c_str(), stages[i].second);
+            res += buf;
+        }
+        res += "}, \"counters\": {";
+        for (size_t i=0; i<counters.size(); i++) {
+            snprintf(buf, sizeof(buf), "%s\"%s\": %lld", i ? ", " : "", counters[i].first.c_str(), counters[i].second);
+            res += buf;
+        }
+        return res + "}";
+    }
+};
+
+inline std::string jsonString(const std::string& s) {
+    std::string res = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += c;
+        } else if (c < 32) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            res += buf;
+        } else {
+            res += c;
+        }
+    }
+    return res + "\"";
+}
+
+// Profile collecting for the current thread, null when not profiling
+inline Profile*& current_profile() {
+    thread_local Profile *p = nullptr;
+    return p;
+}
+
+inline void profileCount(const char *name, long long n) {
+    if (Profile *p = current_profile()) p->count(name, n);
+}
+
+// Charges the time until the end of the scope to a stage of the current profile
+struct Stage {
+    typedef std::chrono::steady_clock Clock;
+
+    const char *name;
+    Profile *profile;
+    Stage *parent;
+    Clock::time_point start;
+
+    static Stage*& active() {
+        thread_local Stage *s = nullptr;
+        return s;
+    }
+
+    Stage(const char *name) : name(name), profile(current_profile()), parent(nullptr) {
+        if (!profile) return;
+        start = Clock::now();
+        parent = active();
+        if (parent) parent->profile->time(parent->name, std::chrono::duration<double>(start - parent->start).count());
+        active() = this;
+    }
+
+    ~Stage() {
+        if (!profile) return;
+        auto now = Clock::now();
+        profile->time(name, std::chrono::duration<double>(now - start).count());
+        active() = parent;
+        if (parent) parent->start = now;
+    }
+
+    Stage(const Stage&) = delete;
+    Stage& operator=(const Stage&) = delete;
+};
+
+// Profiles the current thread into p for the lifetime of the scope
+struct ProfileScope {
+    Profile *saved;
+    Stage::Clock::time_point start;
+    ProfileScope(Profile *p) : saved(current_profile()), start(Stage::Clock::now()) {
+        current_profile() = p;
+    }
+    ~ProfileScope() {
+        if (Profile *p = current_profile()) {
+            p->seconds += std::chrono::duration<double>(Stage::Clock::now() - start).count();
+            p->runs++;
+        }
+        current_profile() = saved;
+    }
+};
+
+#endif
@@ -0,0 +1,292 @@
+#if !defined(SERVER_H_INCLUDED)
+#define SERVER_H_INCLUDED
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "threads.h"
+#include "profile.h"
+
+// Request server on a Unix domain socket. Clients send any number of
+// requests per connection, each a header line of space separated words
+// optionally followed by a payload:
+//
+//   COMMAND [args...]\n             commands without payload
+//   COMMAND size [args...]\n<size bytes>   commands listed in 'payload'
+//   STATS\n                         request counts and latencies
+//
+// and read one reply line per request, in order. Requests run on a pool of
+// workers; at most 'queue' requests wait for one, further requests are
+// answered {"status": "busy"} immediately so clients can back off instead
+// of piling up. At most 'connections' clients are served at once, further
+// ones get the busy reply and are closed, as are clients that send nothing
+// (or don't read their replies) for 'timeout' seconds. Latencies are measured
+// from the end of the request to its reply being ready, so they include the
+// queue wait.
+struct Request {
+    std::vector<std::string> words;             // header, words[0] is the command
+    std::vector<unsigned char> payload;
+};
+
+struct Server {
+    typedef std::function<std::string(const Request&)> Handler;
+    typedef std::chrono::steady_clock Clock;
+
+    std::string path;
+    std::vector<std::string> payload;
+    Handler handler;
+    size_t max_payload;
+    int queue, max_connections, timeout;
+    ThreadPool pool;
+    std::atomic<int> inflight{0}, connections{0};
+
+    std::mutex m;
+    std::vector<double> latencies;              // last 'window' requests, seconds
+    size_t window = 65536, count = 0;
+    long long requests = 0, errors = 0, rejected = 0;
+    Clock::time_point start = Clock::now();
+
+    Server(const std::string& path, int workers, int queue, int max_connections, int timeout,
+           const std::vector<std::string>& payload, size_t max_payload, Handler handler)
+        : path(path), payload(payload), handler(handler), max_payload(max_payload),
+          queue(queue), max_connections(max_connections), timeout(timeout), pool(workers)
+    { }
+
+    // Write end of the pipe SIGTERM and SIGINT make readable to stop run()
+    static int& stop_fd() {
+        static int fd = -1;
+        return fd;
+    }
+
+    static std::string errorReply(const std::string& msg) {
+        return "{\"status\": \"error\", \"error\": " + jsonString(msg) + "}\n";
+    }
+
+    void record(double seconds, bool error) {
+        std::lock_guard<std::mutex> lock(m);
+        if (latencies.size() < window) latencies.push_back(seconds);
+        else latencies[count % window] = seconds;
+        count++;
+        requests++;
+        errors += error;
+    }
+
+    std::string stats() {
+        std::vector<double> l;
+        char buf[512];
+        {
+            std::lock_guard<std::mutex> lock(m);
+            l = latencies;
+            std::sort(l.begin(), l.end());
+            auto pct = [&](double p) { return l.size() ? l[std::min(l.size()-1, size_t(p*l.size()))]*1e3 : 0.; };
+            double sum = 0;
+            for (double x : l) sum += x;
+            snprintf(buf, sizeof(buf),
+                     "{\"status\": \"ok\", \"uptime\": %.3f, \"requests\": %lld, \"errors\": %lld, \"rejected\": %lld, "
+                     "\"inflight\": %d, \"connections\": %d, \"workers\": %d, \"queue\": %d, \"latency_ms\": {\"samples\": %d, "
+                     "\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}}\n",
+                     std::chrono::duration<double>(Clock::now() - start).count(), requests, errors, rejected,
+                     int(inflight), int(connections), pool.size(), queue, int(l.size()), l.size() ? sum/l.size()*1e3 : 0.,
+                     pct(0.5), pct(0.9), pct(0.99), l.size() ? l.back()*1e3 : 0.);
+        }
+        return buf;
+    }
+
+    // Runs a request on the pool, or rejects it when too many are waiting
+    std::string dispatch(Request& req) {
+        if (req.words[0] == "STATS") return stats();
+        if (inflight++ >= pool.size() + queue) {
+            inflight--;
+            std::lock_guard<std::mutex> lock(m);
+            rejected++;
+            return "{\"status\": \"busy\"}\n";
+        }
+        auto t0 = Clock::now();
+        std::promise<std::string> reply;
+        std::future<std::string> res = reply.get_future();
+        pool.submit([&](){
+                        std::string s;
+                        bool error = false;
+                        try {
+                            s = handler(req);
+                        } catch (std::exception& e) {
+                            s = errorReply(e.what());
+                            error = true;
+                        }
+                        record(std::chrono::duration<double>(Clock::now() - t0).count(), error);
+                        inflight--;
+                        reply.set_value(s);
+                    });
+        return res.get();
+    }
+
+    void connection(int fd) {
+        // Blocked reads and writes fail after the timeout, closing the connection
+        timeval tv{timeout, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        std::vector<unsigned char> buf;
+        size_t pos = 0;
+        // Fills buf to at least n bytes after pos, false at end of input
+        auto fill = [&](size_t n) {
+                        if (pos > 65536 && pos*2 > buf.size()) {
+                            buf.erase(buf.begin(), buf.begin() + pos);
+                            pos = 0;
+                        }
+                        while (buf.size() - pos < n) {
+                            size_t sz = buf.size();
+                            buf.resize(sz + std::max<size_t>(65536, n - (sz - pos)));
+                            ssize_t r = read(fd, &buf[sz], buf.size() - sz);
+                            buf.resize(sz + std::max<ssize_t>(r, 0));
+                            if (r < 0 && errno == EINTR) continue;
+                            if (r <= 0) return false;
+                        }
+                        return true;
+                    };
+        auto send = [&](const std::string& s) {
+                        for (size_t i=0; i<s.size(); ) {
+                            ssize_t r = write(fd, s.data() + i, s.size() - i);
+                            if (r < 0 && errno == EINTR) continue;
+                            if (r <= 0) return false;
+                            i += r;
+                        }
+                        return true;
+                    };
+        for (;;) {
+            size_t eol;
+            for (;;) {
+                auto it = std::find(buf.begin() + pos, buf.end(), '\n');
+                if (it != buf.end()) {
+                    eol = it - buf.begin();
+                    break;
+                }
+                if (buf.size() - pos > 4096) {
+                    send(errorReply("Request header too long"));
+                    close(fd);
+                    return;
+                }
+                if (!fill(buf.size() - pos + 1)) {
+                    close(fd);
+                    return;
+                }
+            }
+            Request req;
+            std::string word;
+            for (size_t i=pos; i<=eol; i++) {
+                char c = i < eol ? buf[i] : ' ';
+                if (c == ' ' || c == '\r' || c == '\t') {
+                    if (word.size()) req.words.push_back(word);
+                    word.clear();
+                } else {
+                    word += c;
+                }
+            }
+            pos = eol + 1;
+            if (req.words.empty()) continue;
+            if (std::find(payload.begin(), payload.end(), req.words[0]) != payload.end()) {
+                char *end = nullptr;
+                unsigned long long n = req.words.size() > 1 ? strtoull(req.words[1].c_str(), &end, 10) : 0;
+                if (req.words.size() < 2 || *end || n > max_payload) {
+                    send(errorReply("Invalid payload size"));
+                    close(fd);
+                    return;
+                }
+                if (!fill(n)) {
+                    close(fd);
+                    return;
+                }
+                req.payload.assign(buf.begin() + pos, buf.begin() + pos + n);
+                pos += n;
+            }
+            if (!send(dispatch(req))) break;
+        }
+        close(fd);
+    }
+
+    // Accepts connections, one thread each, until SIGTERM or SIGINT; the
+    // connection threads still running are left to the caller
+    void run() {
+        signal(SIGPIPE, SIG_IGN);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("Socket path too long '" + path + "'");
+        strcpy(addr.sun_path, path.c_str());
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) throw std::runtime_error("Error creating socket");
+        unlink(path.c_str());
+        if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+            close(fd);
+            throw std::runtime_error("Error listening on '" + path + "': " + strerror(errno));
+        }
+        int sig[2];
+        if (pipe(sig) != 0) {
+            close(fd);
+            throw std::runtime_error(std::string("Error creating pipe: ") + strerror(errno));
+        }
+        stop_fd() = sig[1];
+        struct sigaction sa{};
+        sa.sa_handler = [](int) {
+                            char c = 0;
+                            ssize_t r = write(stop_fd(), &c, 1);
+                            (void)r;
+                        };
+        sigaction(SIGTERM, &sa, nullptr);
+        sigaction(SIGINT, &sa, nullptr);
+        fprintf(stderr, "Listening on %s with %i workers\n", path.c_str(), pool.size());
+        for (;;) {
+            pollfd p[2] = {{fd, POLLIN, 0}, {sig[0], POLLIN, 0}};
+            if (poll(p, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("Error waiting for connections: ") + strerror(errno));
+            }
+            if (p[1].revents) break;
+            int c = accept(fd, nullptr, nullptr);
+            if (c < 0) {
+                int e = errno;
+                if (e == EINTR || e == ECONNABORTED) continue;
+                if (e == EBADF || e == EINVAL || e == ENOTSOCK || e == EFAULT) {
+                    throw std::runtime_error(std::string("Error accepting connections: ") + strerror(e));
+                }
+                fprintf(stderr, "Error accepting a connection: %s\n", strerror(e));
+                // Out of descriptors or memory: give open connections time to
+                // close, still watching for the stop signal
+                if (e == EMFILE || e == ENFILE || e == ENOBUFS || e == ENOMEM) poll(&p[1], 1, 100);
+                continue;
+            }
+            if (connections++ >= max_connections) {
+                connections--;
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    rejected++;
+                }
+                static const char busy[] = "{\"status\": \"busy\"}\n";
+                ssize_t r = write(c, busy, sizeof(busy) - 1);
+                (void)r;
+                close(c);
+                continue;
+            }
+            std::thread([this, c](){ connection(c); connections--; }).detach();
+        }
+        close(fd);
+        unlink(path.c_str());
+        fprintf(stderr, "Stopped with %i connections open\n", int(connections));
+    }
+};
+
+#endif
@@ -0,0 +1,43 @@
+#if !defined(SIMD_H_INCLUDED)
+#define SIMD_H_INCLUDED
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+// Vector kernels are compiled per instruction set with target attributes and
+// picked at runtime, so the binary still runs on machines without AVX2.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD_X86 1
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+enum SimdLevel { SIMD_NONE, SIMD_SSE2, SIMD_AVX2 };
+
+inline SimdLevel simd_supported() {
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+    return SIMD_NONE;
+}
+
+inline SimdLevel& simd_level() {
+    static SimdLevel level = simd_supported();
+    return level;
+}
+
+// "auto", "none", "sse2" or "avx2"; never goes above what the CPU supports
+inline void set_simd(const std::string& name) {
+    SimdLevel level;
+    if (name == "auto") level = SIMD_AVX2;
+    else if (name == "none") level = SIMD_NONE;
+    else if (name == "sse2") level = SIMD_SSE2;
+    else if (name == "avx2") level = SIMD_AVX2;
+    else throw std::runtime_error("Unknown SIMD level '" + name + "'");
+    simd_level() = std::min(level, simd_supported());
+}
+
+#endif
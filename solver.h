@@ -0,0 +1,430 @@
+#if !defined(SOLVER_H_INCLUDED)
+#define SOLVER_H_INCLUDED
+
+#include <limits.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include "threads.h"
+
+struct SolverStats {
+    long long nodes = 0, backtracks = 0;
+};
+
+// A solver completes in place a 9x9 grid stored by rows (0 = empty cell,
+// 1..9 = digit). When there's no solution it returns false and leaves the
+// grid unchanged.
+//
+// count() goes on searching after the first solution: it returns the number
+// of solutions up to limit (0 = all, 2 is enough to know whether a puzzle
+// is unique) and completes the grid with the first one, the same solve()
+// finds. Engines that can split the search tree do it on the calling thread
+// and the workers of a long-lived pool (null = serial).
+struct Solver {
+    virtual ~Solver() {}
+    virtual bool solve(int *grid, SolverStats& stats) const = 0;
+    virtual long long count(int *grid, long long limit, ThreadPool *pool, SolverStats& stats) const = 0;
+};
+
+// Checks that givens are in range and don't repeat in a row, column or box
+inline bool validGrid(const int *grid) {
+    unsigned used[27] = {};
+    for (int i=0; i<81; i++) {
+        if (grid[i]) {
+            if (grid[i] < 0 || grid[i] > 9) return false;
+            int r = i/9, c = i%9, b = r/3*3 + c/3, m = 1 << (grid[i]-1);
+            if ((used[r] | used[9+c] | used[18+b]) & m) return false;
+            used[r] |= m; used[9+c] |= m; used[18+b] |= m;
+        }
+    }
+    return true;
+}
+
+// The original solver: rescans the grid at every level, plays forced
+// singles one per level and branches on the last multi-choice cell found
+struct BacktrackSolver : Solver {
+    struct State {
+        int *data;
+        unsigned used[27];
+        SolverStats& stats;
+        long long found, limit;         // solutions, stopping at limit (0 = never)
+        int first[81];
+    };
+
+    static void play(State& s, int i, int j, int d) {
+        int m = 1<<(d-1), b = i/3*3 + j/3;
+        s.data[i*9+j] ^= d;
+        s.used[i] ^= m;
+        s.used[9+j] ^= m;
+        s.used[18+b] ^= m;
+    }
+
+    static bool search(State& s) {
+        s.stats.nodes++;
+        int choice = -1;
+        for (int i=0; i<9; i++) {
+            for (int j=0; j<9; j++) {
+                if (s.data[i*9+j] == 0) {
+                    int b = i/3*3 + j/3;
+                    unsigned a = 511 - (s.used[i] | s.used[9+j] | s.used[18+b]);
+                    if (a == 0) return false;
+                    if ((a & (a-1)) == 0) {
+                        int d = 1;
+                        while (a>1) {
+                            d++;
+                            a = a>>1;
+                        }
+                        play(s, i, j, d);
+                        bool ok = search(s);
+                        if (!ok) play(s, i, j, d);
+                        return ok;
+                    } else {
+                        choice = i*9+j;
+                    }
+                }
+            }
+        }
+        if (choice == -1) {
+            if (s.found++ == 0) memcpy(s.first, s.data, sizeof(s.first));
+            return s.limit && s.found >= s.limit;
+        }
+        int i = choice/9, j = choice%9;
+        int b = i/3*3 + j/3;
+        unsigned u = s.used[i] | s.used[9+j] | s.used[18+b];
+        for (int d=1; d<=9; d++) {
+            if (((1<<(d-1)) & u) == 0) {
+                play(s, i, j, d);
+                if (search(s)) return true;
+                play(s, i, j, d);
+                s.stats.backtracks++;
+            }
+        }
+        return false;
+    }
+
+    bool solve(int *grid, SolverStats& stats) const override {
+        return count(grid, 1, nullptr, stats) > 0;
+    }
+
+    long long count(int *grid, long long limit, ThreadPool *, SolverStats& stats) const override {
+        if (!validGrid(grid)) return 0;
+        State s{grid, {}, stats, 0, limit, {}};
+        for (int i=0; i<81; i++) {
+            if (grid[i]) {
+                int m = 1 << (grid[i]-1), r = i/9, c = i%9;
+                s.used[r] |= m; s.used[9+c] |= m; s.used[18+r/3*3+c/3] |= m;
+            }
+        }
+        search(s);
+        if (s.found) memcpy(grid, s.first, sizeof(s.first));
+        return s.found;
+    }
+};
+
+// Bitboard engine: for every digit the cells where it's still possible are
+// kept as three 27-bit words (one per band of three rows), so placing a digit,
+// naked/hidden single propagation and contradiction checks are a few bitwise
+// operations per digit. Branching picks a bivalue cell when there's one,
+// otherwise the cell with the fewest candidates.
+struct BitboardSolver : Solver {
+    struct Tables {
+        unsigned peers[81][3];         // peer cells of each cell
+        unsigned units[81];            // row, column and box bits (0-8, 9-17, 18-26)
+        unsigned boxmask[3];           // box s of a band
+
+        Tables() {
+            for (int i=0; i<81; i++) {
+                int r = i/9, c = i%9, b = r/3*3 + c/3;
+                units[i] = (1 << r) | (1 << (9+c)) | (1 << (18+b));
+            }
+            for (int i=0; i<81; i++) {
+                peers[i][0] = peers[i][1] = peers[i][2] = 0;
+                for (int j=0; j<81; j++) {
+                    if (j != i && (units[j] & units[i])) peers[i][j/27] |= 1 << (j%27);
+                }
+            }
+            for (int s=0; s<3; s++) boxmask[s] = 0007007007 << (3*s);
+        }
+    };
+
+    static const Tables& tables() {
+        static Tables t;
+        return t;
+    }
+
+    struct State {
+        unsigned cand[9][3];            // candidate cells per digit
+        unsigned unsolved[3];
+        unsigned placed[9];             // units where a digit is already placed
+        unsigned char value[81];
+    };
+
+    static void place(State& s, int i, int k, const Tables& t) {
+        int w = i/27;
+        unsigned bit = 1u << (i%27);
+        for (int d=0; d<9; d++) s.cand[d][w] &= ~bit;
+        for (int j=0; j<3; j++) s.cand[k][j] &= ~t.peers[i][j];
+        s.unsolved[w] &= ~bit;
+        s.placed[k] |= t.units[i];
+        s.value[i] = k+1;
+    }
+
+    // Naked and hidden singles until nothing changes; false on contradiction
+    static bool propagate(State& s, const Tables& t) {
+        for (;;) {
+            bool progress = false;
+            for (int w=0; w<3; w++) {
+                unsigned one = 0, two = 0;
+                for (int k=0; k<9; k++) {
+                    two |= one & s.cand[k][w];
+                    one |= s.cand[k][w];
+                }
+                if (s.unsolved[w] & ~one) return false;
+                for (unsigned singles = one & ~two; singles; singles &= singles-1) {
+                    int p = __builtin_ctz(singles), k = 0;
+                    while (k < 9 && !(s.cand[k][w] & (1u << p))) k++;
+                    if (k == 9) return false;
+                    place(s, w*27 + p, k, t);
+                    progress = true;
+                }
+            }
+            if (progress) continue;
+            for (int k=0; k<9; k++) {
+                unsigned *c = s.cand[k];
+                unsigned rows = 0, once = 0, twice = 0;
+                for (int w=0; w<3; w++) {
+                    for (int r=0; r<3; r++) {
+                        unsigned x = (c[w] >> (9*r)) & 511;
+                        if (x) rows |= 1 << (w*3 + r);
+                        if (x && (x & (x-1)) == 0) {
+                            place(s, w*27 + 9*r + __builtin_ctz(x), k, t);
+                            progress = true;
+                        }
+                        twice |= once & x;
+                        once |= x;
+                    }
+                }
+                // Every row and column needs the digit placed or a candidate
+                if (((rows | s.placed[k]) & 511) != 511 || ((once | s.placed[k] >> 9) & 511) != 511) return false;
+                for (unsigned cols = once & ~twice; cols; cols &= cols-1) {
+                    unsigned m = 1u << __builtin_ctz(cols);
+                    for (int w=0; w<3; w++) {
+                        unsigned x = c[w] & (m | m << 9 | m << 18);
+                        if (x) {
+                            place(s, w*27 + __builtin_ctz(x), k, t);
+                            progress = true;
+                            break;
+                        }
+                    }
+                }
+                for (int w=0; w<3; w++) {
+                    for (int b=0; b<3; b++) {
+                        unsigned x = c[w] & t.boxmask[b];
+                        if (x == 0) {
+                            if (!(s.placed[k] & (1 << (18 + w*3 + b)))) return false;
+                        } else if ((x & (x-1)) == 0) {
+                            place(s, w*27 + __builtin_ctz(x), k, t);
+                            progress = true;
+                        }
+                    }
+                }
+            }
+            if (!progress) return true;
+        }
+    }
+
+    // Counter shared by the subtrees of a parallel search. Subtree 'task'
+    // stops once 'limit' solutions were found, but only after one of the
+    // subtrees before it found one: the first solution is then the same
+    // as a serial search finds, whatever the scheduling.
+    struct Shared {
+        std::atomic<long long> found{0};
+        std::atomic<int> first{INT_MAX};        // first subtree with a solution
+        long long limit;
+
+        bool done(int task) const { return limit && found >= limit && first <= task; }
+    };
+
+    // Solutions found by a search, stopping at limit (0 = never)
+    struct Count {
+        long long found = 0, limit = 1;
+        unsigned char first[81];
+        Shared *shared = nullptr;
+        int task = 0;
+    };
+
+    static bool solved(const State& s) { return !(s.unsolved[0] | s.unsolved[1] | s.unsolved[2]); }
+
+    // True when the search must stop
+    static bool leaf(const State& s, Count& c) {
+        if (c.found++ == 0) {
+            memcpy(c.first, s.value, 81);
+            if (c.shared) {
+                int f = c.shared->first;
+                while (c.task < f && !c.shared->first.compare_exchange_weak(f, c.task)) { }
+            }
+        }
+        if (c.shared) {
+            c.shared->found++;
+            return c.shared->done(c.task);
+        }
+        return c.limit && c.found >= c.limit;
+    }
+
+    // Cell to branch on: a bivalue cell when there's one, otherwise the one
+    // with the fewest candidates
+    static int branchCell(const State& s) {
+        // Bivalue cells: candidate count exactly two
+        int best = -1;
+        for (int w=0; w<3 && best<0; w++) {
+            unsigned one = 0, two = 0, more = 0;
+            for (int k=0; k<9; k++) {
+                more |= two & s.cand[k][w];
+                two |= one & s.cand[k][w];
+                one |= s.cand[k][w];
+            }
+            if (unsigned pairs = two & ~more) best = w*27 + __builtin_ctz(pairs);
+        }
+        if (best < 0) {
+            int bc = 10;
+            for (int i=0; i<81; i++) {
+                if (s.unsolved[i/27] & (1u << (i%27))) {
+                    int n = 0;
+                    for (int k=0; k<9; k++) n += (s.cand[k][i/27] >> (i%27)) & 1;
+                    if (n < bc) { bc = n; best = i; }
+                }
+            }
+        }
+        return best;
+    }
+
+    static bool search(State& s, SolverStats& stats, const Tables& t, Count& c) {
+        stats.nodes++;
+        if (c.shared && c.shared->done(c.task)) return true;
+        if (!propagate(s, t)) return false;
+        if (solved(s)) return leaf(s, c);
+        int best = branchCell(s);
+        int w = best/27;
+        unsigned bit = 1u << (best%27);
+        for (int k=0; k<9; k++) {
+            if (s.cand[k][w] & bit) {
+                State ns = s;
+                place(ns, best, k, t);
+                if (search(ns, stats, t, c)) {
+                    s = ns;
+                    return true;
+                }
+                stats.backtracks++;
+                s.cand[k][w] &= ~bit;
+            }
+        }
+        return false;
+    }
+
+    static State start(const int *grid, const Tables& t) {
+        State s;
+        for (int k=0; k<9; k++) {
+            s.cand[k][0] = s.cand[k][1] = s.cand[k][2] = (1 << 27) - 1;
+            s.placed[k] = 0;
+        }
+        s.unsolved[0] = s.unsolved[1] = s.unsolved[2] = (1 << 27) - 1;
+        for (int i=0; i<81; i++) {
+            if (grid[i]) place(s, i, grid[i]-1, t);
+        }
+        return s;
+    }
+
+    bool solve(int *grid, SolverStats& stats) const override {
+        const Tables& t = tables();
+        if (!validGrid(grid)) return false;
+        State s = start(grid, t);
+        Count c;
+        if (!search(s, stats, t, c)) return false;
+        for (int i=0; i<81; i++) grid[i] = s.value[i];
+        return true;
+    }
+
+    // With a pool the top levels of the tree are expanded breadth first,
+    // keeping the children in branching order, until there are 8 subtrees
+    // per thread, and the subtrees are taken one at a time by the calling
+    // thread and the workers
+    long long count(int *grid, long long limit, ThreadPool *pool, SolverStats& stats) const override {
+        const Tables& t = tables();
+        if (!validGrid(grid)) return 0;
+        int threads = pool ? pool->size() + 1 : 1;
+        if (threads <= 1) {
+            State s = start(grid, t);
+            Count c;
+            c.limit = limit;
+            search(s, stats, t, c);
+            for (int i=0; c.found && i<81; i++) grid[i] = c.first[i];
+            return c.found;
+        }
+        std::vector<State> tree(1, start(grid, t));
+        while (tree.size() < size_t(8*threads)) {
+            std::vector<State> next;
+            bool split = false;
+            for (auto& s : tree) {
+                stats.nodes++;
+                if (!propagate(s, t)) continue;
+                if (solved(s)) {
+                    next.push_back(s);
+                    continue;
+                }
+                int best = branchCell(s), w = best/27;
+                for (int k=0; k<9; k++) {
+                    if (s.cand[k][w] & (1u << (best%27))) {
+                        next.push_back(s);
+                        place(next.back(), best, k, t);
+                        split = true;
+                    }
+                }
+            }
+            tree.swap(next);
+            if (!split) break;
+        }
+        Shared shared;
+        shared.limit = limit;
+        std::vector<Count> counts(tree.size());
+        std::vector<SolverStats> substats(tree.size());
+        auto subtree = [&](int i) {
+                           counts[i].limit = limit;
+                           counts[i].shared = &shared;
+                           counts[i].task = i;
+                           search(tree[i], substats[i], t, counts[i]);
+                       };
+        parallel_for(*pool, tree.size(), subtree);
+        long long found = 0;
+        const Count *first = nullptr;
+        for (size_t i=0; i<tree.size(); i++) {
+            stats.nodes += substats[i].nodes;
+            stats.backtracks += substats[i].backtracks;
+            found += counts[i].found;
+            if (!first && counts[i].found) first = &counts[i];
+        }
+        if (first) {
+            for (int i=0; i<81; i++) grid[i] = first->first[i];
+        }
+        return limit ? std::min(found, limit) : found;
+    }
+};
+
+inline std::unique_ptr<Solver> makeSolver(const std::string& name) {
+    if (name == "backtrack") return std::unique_ptr<Solver>(new BacktrackSolver);
+    if (name == "bitboard") return std::unique_ptr<Solver>(new BitboardSolver);
+    throw std::runtime_error("Unknown solver '" + name + "'");
+}
+
+// Shared instance of a solver engine, as solvers keep no state
+inline const Solver& solverNamed(const std::string& name) {
+    static const BacktrackSolver backtrack;
+    static const BitboardSolver bitboard;
+    if (name == "backtrack") return backtrack;
+    if (name == "bitboard") return bitboard;
+    throw std::runtime_error("Unknown solver '" + name + "'");
+}
+
+#endif
@@ -1,48 +1,337 @@
-#include <functional>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <queue>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "images.h"
 #include "random.h"
 #include "argv.h"
+#include "threads.h"
+#include "solver.h"
+#include "bank.h"
+#include "matcher.h"
+#include "cache.h"
+#include "simd.h"
+#include "profile.h"
+#include "server.h"
 
-template<typename T>
-double bili(Image<T>& img, double x, double y) {
-    int ix = std::max(0, std::min(img.w-2, int(x-0.5))),
-        iy = std::max(0, std::min(img.h-2, int(y-0.5)));
-    double fx = x-0.5 - ix, fy = y-0.5 - iy;
-    return ((img(ix, iy)*(1-fx) + img(ix+1, iy)*fx)*(1-fy) +
-            (img(ix, iy+1)*(1-fx) + img(ix+1, iy+1)*fx)*fy);
+// Counting heap allocations, see heap_allocations(); the deletes are kept
+// out of line, otherwise gcc sees free() of an operator new pointer
+void *operator new(size_t n) {
+    heap_allocations()++;
+    if (void *p = malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
 }
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+
+// The adaptive threshold blurs the image with a forward and a backward
+// exponential filter along rows and then along columns. Every kernel variant
+// does the same float operations in the same order, so results don't depend
+// on the instruction set in use.
+
+// Vertical step over a whole row: p = q*k + p*(1-k). Rows are contiguous so
+// this runs across columns with full vectors.
+static void blurStep(float *p, const float *q, int n, float k, float k1) {
+    for (int i=0; i<n; i++) p[i] = q[i]*k + p[i]*k1;
+}
+
+// Horizontal filter of nr rows (stride w). Each row is a serial dependency,
+// so rows are interleaved to overlap their chains.
+static void blurRows(float *p, int nr, int w, float k, float k1) {
+    for (int y=0; y<nr; y+=4) {
+        float *r[4];
+        int n = std::min(4, nr-y);
+        for (int j=0; j<n; j++) r[j] = p + size_t(y+j)*w;
+        for (int i=1; i<w; i++) {
+            for (int j=0; j<n; j++) r[j][i] = r[j][i-1]*k + r[j][i]*k1;
+        }
+        for (int i=w-2; i>=0; i--) {
+            for (int j=0; j<n; j++) r[j][i] = r[j][i+1]*k + r[j][i]*k1;
+        }
+    }
+}
+
+static void thresholdRow(unsigned char *dst, const float *base, int n, float t) {
+    for (int i=0; i<n; i++) dst[i] = (dst[i] > base[i]*t ? 255 : 0);
+}
+
+#if defined(SIMD_X86)
+SIMD_TARGET("sse2")
+static void blurStepSSE2(float *p, const float *q, int n, float k, float k1) {
+    __m128 vk = _mm_set1_ps(k), vk1 = _mm_set1_ps(k1);
+    int i = 0;
+    for (; i+4<=n; i+=4) {
+        _mm_storeu_ps(p+i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(q+i), vk),
+                                      _mm_mul_ps(_mm_loadu_ps(p+i), vk1)));
+    }
+    blurStep(p+i, q+i, n-i, k, k1);
+}
+
+SIMD_TARGET("avx2")
+static void blurStepAVX2(float *p, const float *q, int n, float k, float k1) {
+    __m256 vk = _mm256_set1_ps(k), vk1 = _mm256_set1_ps(k1);
+    int i = 0;
+    for (; i+8<=n; i+=8) {
+        _mm256_storeu_ps(p+i, _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(q+i), vk),
+                                            _mm256_mul_ps(_mm256_loadu_ps(p+i), vk1)));
+    }
+    blurStep(p+i, q+i, n-i, k, k1);
+}
+
+SIMD_TARGET("avx2")
+static inline void transpose8(__m256 *v) {
+    __m256 t[8], u[8];
+    for (int i=0; i<8; i+=2) {
+        t[i] = _mm256_unpacklo_ps(v[i], v[i+1]);
+        t[i+1] = _mm256_unpackhi_ps(v[i], v[i+1]);
+    }
+    for (int i=0; i<8; i+=4) {
+        u[i] = _mm256_shuffle_ps(t[i], t[i+2], 0x44);
+        u[i+1] = _mm256_shuffle_ps(t[i], t[i+2], 0xEE);
+        u[i+2] = _mm256_shuffle_ps(t[i+1], t[i+3], 0x44);
+        u[i+3] = _mm256_shuffle_ps(t[i+1], t[i+3], 0xEE);
+    }
+    for (int i=0; i<4; i++) {
+        v[i] = _mm256_permute2f128_ps(u[i], u[i+4], 0x20);
+        v[i+4] = _mm256_permute2f128_ps(u[i], u[i+4], 0x31);
+    }
+}
+
+SIMD_TARGET("avx2")
+static inline void loadTile(__m256 *v, const float *r, int w, int x) {
+    for (int j=0; j<8; j++) v[j] = _mm256_loadu_ps(r + size_t(j)*w + x);
+    transpose8(v);
+}
+
+SIMD_TARGET("avx2")
+static inline void storeTile(__m256 *v, float *r, int w, int x) {
+    transpose8(v);
+    for (int j=0; j<8; j++) _mm256_storeu_ps(r + size_t(j)*w + x, v[j]);
+}
+
+// Horizontal filter with one row per lane: 8x8 tiles are transposed so each
+// vector holds a column of 8 rows, then columns are filtered in sequence.
+SIMD_TARGET("avx2")
+static void blurRowsAVX2(float *p, int nr, int w, float k, float k1) {
+    int y = 0, nb = w/8*8;
+    __m256 vk = _mm256_set1_ps(k), vk1 = _mm256_set1_ps(k1);
+    for (; y+8<=nr && nb; y+=8) {
+        float *r = p + size_t(y)*w;
+        __m256 v[8], c = _mm256_setzero_ps();
+        for (int x=0; x<nb; x+=8) {
+            loadTile(v, r, w, x);
+            for (int j=(x == 0); j<8; j++) v[j] = _mm256_add_ps(_mm256_mul_ps(j ? v[j-1] : c, vk), _mm256_mul_ps(v[j], vk1));
+            c = v[7];
+            storeTile(v, r, w, x);
+        }
+        for (int j=0; j<8; j++) {
+            float *q = r + size_t(j)*w;
+            for (int i=nb; i<w; i++) q[i] = q[i-1]*k + q[i]*k1;
+            for (int i=w-2; i>=nb; i--) q[i] = q[i+1]*k + q[i]*k1;
+        }
+        for (int x=nb-8; x>=0; x-=8) {
+            loadTile(v, r, w, x);
+            if (x+8 < w) {
+                if (x+8 == nb) {
+                    for (int j=0; j<8; j++) ((float *)&c)[j] = r[size_t(j)*w + nb];
+                }
+                v[7] = _mm256_add_ps(_mm256_mul_ps(c, vk), _mm256_mul_ps(v[7], vk1));
+            }
+            for (int j=6; j>=0; j--) v[j] = _mm256_add_ps(_mm256_mul_ps(v[j+1], vk), _mm256_mul_ps(v[j], vk1));
+            c = v[0];
+            storeTile(v, r, w, x);
+        }
+    }
+    blurRows(p + size_t(y)*w, nr-y, w, k, k1);
+}
+
+SIMD_TARGET("avx2")
+static void thresholdRowAVX2(unsigned char *dst, const float *base, int n, float t) {
+    __m256 vt = _mm256_set1_ps(t);
+    __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    for (; i+32<=n; i+=32) {
+        __m256i m[4];
+        for (int j=0; j<4; j++) {
+            __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(dst+i+8*j))));
+            m[j] = _mm256_castps_si256(_mm256_cmp_ps(v, _mm256_mul_ps(_mm256_loadu_ps(base+i+8*j), vt), _CMP_GT_OQ));
+        }
+        __m256i b = _mm256_packs_epi16(_mm256_packs_epi32(m[0], m[1]), _mm256_packs_epi32(m[2], m[3]));
+        _mm256_storeu_si256((__m256i *)(dst+i), _mm256_permutevar8x32_epi32(b, order));
+    }
+    thresholdRow(dst+i, base+i, n-i, t);
+}
+#endif
 
 void binarize(Image<unsigned char>& img,
               double kblur, double threshold) {
+    Stage stage("binarize");
     int h = img.h, w = img.w;
-    std::vector<double> base(img.data.begin(), img.data.end());
-    auto blur = [&](double *p, int step, int n, double kblur) {
-                    for (int i=1; i<n; i++) {
-                        p[i*step] = p[(i-1)*step]*kblur + p[i*step]*(1-kblur);
-                    }
-                    for (int i=n-2; i>=0; i--) {
-                        p[i*step] = p[(i+1)*step]*kblur + p[i*step]*(1-kblur);
-                    }
-                };
-    for (int y=0; y<h; y++) {
-        blur(&base[y*w], 1, w, kblur);
-    }
-    for (int x=0; x<w; x++) {
-        blur(&base[x], w, h, kblur);
+    if (w == 0 || h == 0) return;
+    float k = kblur, k1 = 1 - k, t = threshold;
+    Scratch<float> base(img.data.begin(), img.data.end());
+    auto hblur = blurRows;
+    auto vblur = blurStep;
+    auto thr = thresholdRow;
+#if defined(SIMD_X86)
+    if (simd_level() == SIMD_AVX2) {
+        hblur = blurRowsAVX2;
+        vblur = blurStepAVX2;
+        thr = thresholdRowAVX2;
+    } else if (simd_level() == SIMD_SSE2) {
+        vblur = blurStepSSE2;
     }
-    for (int i=0; i<w*h; i++) img[i] = (img[i] > base[i]*threshold ? 255 : 0);
+#endif
+    hblur(&base[0], h, w, k, k1);
+    for (int y=1; y<h; y++) vblur(&base[size_t(y)*w], &base[size_t(y-1)*w], w, k, k1);
+    for (int y=h-2; y>=0; y--) vblur(&base[size_t(y)*w], &base[size_t(y+1)*w], w, k, k1);
+    for (int y=0; y<h; y++) thr(&img.data[size_t(y)*w], &base[size_t(y)*w], w, t);
 }
 
 struct P { double x, y; };
 
-struct Blob {
-    std::vector<P> pts;
-    int x0, y0, x1, y1;
-};
+// Projective mapping of the unit square on the quad A(0,0) B(1,0) C(0,1) D(1,1)
+// (Heckbert, "Fundamentals of Texture Mapping and Image Warping", 1989)
+std::array<double, 9> squareToQuad(P A, P B, P C, P D) {
+    double sx = A.x - B.x + D.x - C.x, sy = A.y - B.y + D.y - C.y;
+    double dx1 = B.x - D.x, dx2 = C.x - D.x, dy1 = B.y - D.y, dy2 = C.y - D.y;
+    double det = dx1*dy2 - dx2*dy1, g = 0, h = 0;
+    if ((sx != 0 || sy != 0) && det != 0) {
+        g = (sx*dy2 - dx2*sy) / det;
+        h = (dx1*sy - sx*dy1) / det;
+    }
+    return { B.x - A.x + g*B.x,   B.y - A.y + g*B.y,   g,
+             C.x - A.x + h*C.x,   C.y - A.y + h*C.y,   h,
+             A.x,                 A.y,                 1., };
+}
 
-void dt(Image<unsigned char>& img) {
+// Same projective map for pixel coordinates: m applied to
+// (x*sx + ox, y*sy + oy). Along a row the homogeneous coordinates then
+// change by constant steps (m[0], m[1], m[2] per pixel).
+std::array<double, 9> pixelMap(const std::array<double, 9>& m, double sx, double ox, double sy, double oy) {
+    return { m[0]*sx,   m[1]*sx,   m[2]*sx,
+             m[3]*sy,   m[4]*sy,   m[5]*sy,
+             m[0]*ox + m[3]*oy + m[6],   m[1]*ox + m[4]*oy + m[7],   m[2]*ox + m[5]*oy + m[8] };
+}
+
+// Bilinear sample with 8-bit fixed-point weights; coordinates are clamped
+// to the pixel centers so outside samples repeat the border (w, h >= 2)
+static inline int sampleFixed(const unsigned char *src, int w, int h, int stride, float x, float y) {
+    int u = int(std::max(0.f, std::min(float(w-1), x - 0.5f)) * 256.f),
+        v = int(std::max(0.f, std::min(float(h-1), y - 0.5f)) * 256.f);
+    int ix = std::min(u >> 8, w-2), iy = std::min(v >> 8, h-2);
+    int fx = u - ix*256, fy = v - iy*256;
+    const unsigned char *p = src + size_t(iy)*stride + ix;
+    int top = p[0]*(256-fx) + p[1]*fx, bottom = p[stride]*(256-fx) + p[stride+1]*fx;
+    return (top*(256-fy) + bottom*fy) >> 16;
+}
+
+// n pixels of a warped row starting at homogeneous coordinates (X, Y, Z)
+// with steps (dx, dy, dz). Pixel i is at X + i*dx (not accumulated) in
+// float, the same operations in every variant.
+static void warpRow(unsigned char *dst, int i, int n, const unsigned char *src, int w, int h, int stride,
+                    float X, float Y, float Z, float dx, float dy, float dz) {
+    for (; i<n; i++) {
+        float fi = float(i), z = Z + fi*dz;
+        dst[i] = sampleFixed(src, w, h, stride, (X + fi*dx) / z, (Y + fi*dy) / z);
+    }
+}
+
+#if defined(SIMD_X86)
+SIMD_TARGET("avx2")
+static void warpRowAVX2(unsigned char *dst, int i, int n, const unsigned char *src, int w, int h, int stride,
+                        float X, float Y, float Z, float dx, float dy, float dz) {
+    const __m256 half = _mm256_set1_ps(0.5f), zero = _mm256_setzero_ps(), k256 = _mm256_set1_ps(256.f),
+                 xmax = _mm256_set1_ps(float(w-1)), ymax = _mm256_set1_ps(float(h-1));
+    const __m256i ixmax = _mm256_set1_epi32(w-2), iymax = _mm256_set1_epi32(h-2),
+                  vs = _mm256_set1_epi32(stride), k256i = _mm256_set1_epi32(256),
+                  lo = _mm256_set1_epi32(255), last = _mm256_set1_epi32((h-2)*stride + w - 4);
+    const __m256 step = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    for (; i+8<=n; i+=8) {
+        __m256 fi = _mm256_add_ps(_mm256_set1_ps(float(i)), step);
+        __m256 z = _mm256_add_ps(_mm256_set1_ps(Z), _mm256_mul_ps(fi, _mm256_set1_ps(dz)));
+        __m256 x = _mm256_div_ps(_mm256_add_ps(_mm256_set1_ps(X), _mm256_mul_ps(fi, _mm256_set1_ps(dx))), z);
+        __m256 y = _mm256_div_ps(_mm256_add_ps(_mm256_set1_ps(Y), _mm256_mul_ps(fi, _mm256_set1_ps(dy))), z);
+        __m256i u = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_max_ps(zero, _mm256_min_ps(xmax, _mm256_sub_ps(x, half))), k256));
+        __m256i v = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_max_ps(zero, _mm256_min_ps(ymax, _mm256_sub_ps(y, half))), k256));
+        __m256i ix = _mm256_min_epi32(_mm256_srli_epi32(u, 8), ixmax),
+                iy = _mm256_min_epi32(_mm256_srli_epi32(v, 8), iymax);
+        __m256i fx = _mm256_sub_epi32(u, _mm256_slli_epi32(ix, 8)),
+                fy = _mm256_sub_epi32(v, _mm256_slli_epi32(iy, 8));
+        __m256i off = _mm256_add_epi32(_mm256_mullo_epi32(iy, vs), ix);
+        // 32-bit reads of the lower row could pass the end of the image
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(off, last))) {
+            warpRow(dst, i, i+8, src, w, h, stride, X, Y, Z, dx, dy, dz);
+            continue;
+        }
+        __m256i a = _mm256_i32gather_epi32((const int *)src, off, 1),
+                b = _mm256_i32gather_epi32((const int *)(src + stride), off, 1);
+        __m256i fx1 = _mm256_sub_epi32(k256i, fx);
+        __m256i top = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(a, lo), fx1),
+                                       _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(a, 8), lo), fx));
+        __m256i bottom = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(b, lo), fx1),
+                                          _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(b, 8), lo), fx));
+        __m256i r = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(top, _mm256_sub_epi32(k256i, fy)),
+                                                       _mm256_mullo_epi32(bottom, fy)), 16);
+        __m128i r16 = _mm_packus_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+        _mm_storel_epi64((__m128i *)(dst+i), _mm_packus_epi16(r16, r16));
+    }
+    warpRow(dst, i, n, src, w, h, stride, X, Y, Z, dx, dy, dz);
+}
+#endif
+
+// dst(x, y) = src sampled at the pixel map m (see pixelMap) of (x, y).
+// Each row starts from homogeneous coordinates computed in double and
+// steps from there.
+void warp(const ImageView<unsigned char>& src, Image<unsigned char>& dst, const std::array<double, 9>& m) {
+    if (src.w < 2 || src.h < 2) {
+        std::fill(dst.data.begin(), dst.data.end(), src(0, 0));
+        return;
+    }
+    auto row = warpRow;
+#if defined(SIMD_X86)
+    if (simd_level() == SIMD_AVX2) row = warpRowAVX2;
+#endif
+    for (int y=0; y<dst.h; y++) {
+        row(&dst.data[size_t(y)*dst.w], 0, dst.w, src.data, src.w, src.h, src.stride,
+            m[3]*y + m[6], m[4]*y + m[7], m[5]*y + m[8], m[0], m[1], m[2]);
+    }
+}
+
+// Image scaled by s and rotated by a degrees (clockwise) around its center,
+// sized to hold all of it; used for synthetic variants of test images
+Image<unsigned char> transformed(const ImageView<unsigned char>& img, double s, double a) {
+    Stage stage("transform");
+    double c = cos(a*M_PI/180), sn = sin(a*M_PI/180);
+    int w = std::max(1, int(lrint(s*(img.w*fabs(c) + img.h*fabs(sn))))),
+        h = std::max(1, int(lrint(s*(img.w*fabs(sn) + img.h*fabs(c)))));
+    Image<unsigned char> res(w, h);
+    // Inverse mapping of the pixel centers, with (x, y) = (0, 0) at the first one
+    double ox = 0.5 - w*0.5, oy = 0.5 - h*0.5;
+    warp(img, res, {c/s, -sn/s, 0,
+                    sn/s, c/s, 0,
+                    img.w*0.5 + (c*ox + sn*oy)/s, img.h*0.5 + (c*oy - sn*ox)/s, 1});
+    return res;
+}
+
+// Chamfer distance transform (weights 30 and 42) in place: pixels become the
+// distance to the nearest 0 pixel, saturated at 255. The first and last
+// columns and the first (forward pass) and last (backward pass) rows are not
+// updated. Plain version with checked pixel access, kept as the reference
+// for dt() below.
+void dtReference(Image<unsigned char>& img) {
+    Stage stage("dt");
     for (int y=1; y<img.h; y++) {
         for (int x=1; x<img.w-1; x++) {
             img(x, y, std::min(int(img(x, y)),
@@ -59,76 +348,508 @@ void dt(Image<unsigned char>& img) {
     }
 }
 
-Blob blob(Image<unsigned char>& img, int x, int y) {
+// Contribution of the previous row to a chamfer pass, for 1 <= x < w-1:
+// row[x] = min(row[x], prev[x]+30, min(prev[x-1], prev[x+1])+42). It doesn't
+// depend on the other pixels of the row so it vectorizes; saturating adds
+// give the same result as row[x] is at most 255.
+void dtStep(unsigned char *row, const unsigned char *prev, int x, int w) {
+    for (; x<w-1; x++) {
+        row[x] = std::min(int(row[x]), std::min(prev[x]+30, std::min(prev[x-1], prev[x+1])+42));
+    }
+}
+
+#if defined(SIMD_X86)
+SIMD_TARGET("sse2")
+void dtStepSSE2(unsigned char *row, const unsigned char *prev, int x, int w) {
+    const __m128i k30 = _mm_set1_epi8(30), k42 = _mm_set1_epi8(42);
+    for (; x+16<=w-1; x+=16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(prev+x-1)),
+                b = _mm_loadu_si128((const __m128i *)(prev+x)),
+                c = _mm_loadu_si128((const __m128i *)(prev+x+1)),
+                r = _mm_loadu_si128((const __m128i *)(row+x));
+        r = _mm_min_epu8(r, _mm_min_epu8(_mm_adds_epu8(b, k30), _mm_adds_epu8(_mm_min_epu8(a, c), k42)));
+        _mm_storeu_si128((__m128i *)(row+x), r);
+    }
+    dtStep(row, prev, x, w);
+}
+
+SIMD_TARGET("avx2")
+void dtStepAVX2(unsigned char *row, const unsigned char *prev, int x, int w) {
+    const __m256i k30 = _mm256_set1_epi8(30), k42 = _mm256_set1_epi8(42);
+    for (; x+32<=w-1; x+=32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(prev+x-1)),
+                b = _mm256_loadu_si256((const __m256i *)(prev+x)),
+                c = _mm256_loadu_si256((const __m256i *)(prev+x+1)),
+                r = _mm256_loadu_si256((const __m256i *)(row+x));
+        r = _mm256_min_epu8(r, _mm256_min_epu8(_mm256_adds_epu8(b, k30), _mm256_adds_epu8(_mm256_min_epu8(a, c), k42)));
+        _mm256_storeu_si256((__m256i *)(row+x), r);
+    }
+    dtStep(row, prev, x, w);
+}
+#endif
+
+// Same result as dtReference(): each row first takes the (vectorized) terms
+// of the previous row, then the serial chain along the row itself, working
+// on raw rows with the unchanged border left out of the loops.
+void dt(Image<unsigned char>& img) {
+    Stage stage("dt");
     int w = img.w, h = img.h;
-    Blob res{{P{x+0.5, y+0.5}},x,y,x+1,y+1};
-    int c1 = img(x, y);
-    int c2 = (c1 + 1) & 255;
-    img(x, y, c2);
-    std::vector<P> active(res.pts);
-    while (active.size()) {
-        std::vector<P> na;
-        for (auto& p : active) {
-            int x = p.x, y = p.y,
-                x0 = std::max(0, x-1), x1 = std::min(w-1, x+1),
-                y0 = std::max(0, y-1), y1 = std::min(h-1, y+1);
-            for (int yy=y0; yy<=y1; yy++) {
-                for (int xx=x0; xx<=x1; xx++) {
-                    if (img(xx, yy) == c1) {
-                        res.x0 = std::min(res.x0, xx); res.x1 = std::max(res.x1, xx+1);
-                        res.y0 = std::min(res.y0, yy); res.y1 = std::max(res.y1, yy+1);
-                        img(xx, yy, c2);
-                        res.pts.push_back(P{xx+0.5, yy+0.5});
-                        na.push_back(P{xx+0.5, yy+0.5});
-                    }
-                }
+    if (w < 3) return;
+    auto step = dtStep;
+#if defined(SIMD_X86)
+    if (simd_level() == SIMD_AVX2) {
+        step = dtStepAVX2;
+    } else if (simd_level() == SIMD_SSE2) {
+        step = dtStepSSE2;
+    }
+#endif
+    unsigned char *p = &img.data[0];
+    for (int y=1; y<h; y++) {
+        unsigned char *row = p + size_t(y)*w;
+        step(row, row - w, 1, w);
+        for (int x=1, v=row[0]; x<w-1; x++) row[x] = v = std::min(int(row[x]), v+30);
+    }
+    for (int y=h-2; y>=0; y--) {
+        unsigned char *row = p + size_t(y)*w;
+        step(row, row + w, 1, w);
+        for (int x=w-2, v=row[w-1]; x>0; x--) row[x] = v = std::min(int(row[x]), v+30);
+    }
+}
+
+// Exact Euclidean distance transform of the 0 pixels of img, in the units
+// of dt() (30 per pixel) but on 16 bits, so distances don't saturate at 255
+// (Felzenszwalb and Huttenlocher, "Distance Transforms of Sampled
+// Functions", 2012): distances along columns, then the lower envelope of
+// the parabolas of their squares along each row.
+Image<unsigned short> dtEuclid(const Image<unsigned char>& img) {
+    Stage stage("dt");
+    int w = img.w, h = img.h;
+    Image<unsigned short> res(w, h);
+    const int inf = w + h;
+    Scratch<int> g(size_t(w)*h);
+    for (int x=0; x<w; x++) g[x] = img.data[x] ? inf : 0;
+    for (int y=1; y<h; y++) {
+        const unsigned char *src = &img.data[size_t(y)*w];
+        int *row = &g[size_t(y)*w];
+        for (int x=0; x<w; x++) row[x] = src[x] ? std::min(inf, row[x-w] + 1) : 0;
+    }
+    for (int y=h-2; y>=0; y--) {
+        int *row = &g[size_t(y)*w];
+        for (int x=0; x<w; x++) row[x] = std::min(row[x], row[x+w] + 1);
+    }
+    Scratch<long long> f(w);
+    Scratch<int> v(w);
+    Scratch<double> z(w + 1);
+    for (int y=0; y<h; y++) {
+        const int *row = &g[size_t(y)*w];
+        for (int x=0; x<w; x++) f[x] = (long long)row[x]*row[x];
+        int k = 0;
+        v[0] = 0;
+        z[0] = -1e30; z[1] = 1e30;
+        auto cross = [&](int p, int q) {
+                         return ((f[q] + (long long)q*q) - (f[p] + (long long)p*p)) / (2.0*(q - p));
+                     };
+        for (int q=1; q<w; q++) {
+            double s = cross(v[k], q);
+            while (s <= z[k]) s = cross(v[--k], q);
+            k++;
+            v[k] = q;
+            z[k] = s;
+            z[k+1] = 1e30;
+        }
+        unsigned short *dst = &res.data[size_t(y)*w];
+        k = 0;
+        for (int q=0; q<w; q++) {
+            while (z[k+1] < q) k++;
+            long long d = f[v[k]] + (long long)(q - v[k])*(q - v[k]);
+            dst[q] = std::min(65535., floor(30*sqrt(double(d)) + 0.5));
+        }
+    }
+    return res;
+}
+
+// 8-connected components of the pixels with a given value. One raster pass
+// collects horizontal runs and joins each to the touching runs of the row
+// above with union-find; blobs are numbered in raster order of their first
+// pixel and pixel lists are only built on request.
+struct Labeling {
+    struct Run { int y, x0, x1; };
+    Scratch<Run> runs;                  // grouped by blob, raster order inside one
+    Scratch<int> first;                 // runs of blob i are [first[i], first[i+1])
+    Scratch<Blob> blobs;                // bounding box and area, no pixels
+
+    Scratch<Pixel> pixels(int i) const {
+        Scratch<Pixel> res;
+        res.reserve(blobs[i].area);
+        for (int r=first[i]; r<first[i+1]; r++) {
+            for (int x=runs[r].x0; x<runs[r].x1; x++) res.push_back(Pixel{x, runs[r].y});
+        }
+        return res;
+    }
+
+    Blob blob(int i) const {
+        Blob res = blobs[i];
+        res.pts = pixels(i);
+        return res;
+    }
+};
+
+Labeling label(const Image<unsigned char>& img, int value) {
+    Stage stage("label");
+    int w = img.w, h = img.h;
+    Scratch<Labeling::Run> runs;
+    Scratch<int> parent;
+    auto find = [&](int i) {
+        while (parent[i] != i) i = parent[i] = parent[parent[i]];
+        return i;
+    };
+    int prev0 = 0, prev1 = 0;
+    for (int y=0; y<h; y++) {
+        const unsigned char *row = &img.data[size_t(y)*w];
+        int cur0 = runs.size(), k = prev0;
+        for (int x=0; x<w; ) {
+            if (row[x] != value) {
+                x++;
+                continue;
+            }
+            int x0 = x;
+            while (x < w && row[x] == value) x++;
+            int id = runs.size();
+            runs.push_back(Labeling::Run{y, x0, x});
+            parent.push_back(id);
+            // Runs above touching [x0-1, x] diagonally included; the root is
+            // always the run that comes first in raster order
+            while (k < prev1 && runs[k].x1 < x0) k++;
+            for (int j=k; j<prev1 && runs[j].x0 <= x; j++) {
+                int a = find(id), b = find(j);
+                if (a < b) parent[b] = a; else parent[a] = b;
             }
         }
-        active = na;
+        prev0 = cur0;
+        prev1 = runs.size();
+    }
+
+    Labeling res;
+    int n = runs.size(), nb = 0;
+    Scratch<int> id(n);
+    for (int i=0; i<n; i++) {
+        int r = find(i);
+        id[i] = (r == i) ? nb++ : id[r];
+    }
+    res.blobs.resize(nb, Blob{{}, w, h, 0, 0, 0});
+    res.first.assign(nb+1, 0);
+    for (int i=0; i<n; i++) {
+        const Labeling::Run& r = runs[i];
+        Blob& b = res.blobs[id[i]];
+        b.x0 = std::min(b.x0, r.x0); b.x1 = std::max(b.x1, r.x1);
+        b.y0 = std::min(b.y0, r.y); b.y1 = std::max(b.y1, r.y+1);
+        b.area += r.x1 - r.x0;
+        res.first[id[i]+1]++;
     }
+    for (int i=0; i<nb; i++) res.first[i+1] += res.first[i];
+    profileCount("blobs", nb);
+    res.runs.resize(n);
+    Scratch<int> pos(res.first.begin(), res.first.end()-1);
+    for (int i=0; i<n; i++) res.runs[pos[id[i]]++] = runs[i];
     return res;
 }
 
-int main(int argc, const char *argv[]) {
-    PARM(std::string, src_name, "Source filename", "input.pgm");
-    PARM(std::string, digits_name, "Digits reference filename", "digits.pgm");
-    PARM(std::string, output_name, "Output filename", "out.ppm");
-    PARM(std::string, debug_name, "Debug output filename", "");
-    PARM(std::string, binarized_name, "Binarized rectified filename", "");
-    PARM(std::string, binarized_dt_name, "DT-transformed rectified filename", "");
-    PARM(std::string, digits_dt_name, "DT-transformed digits filename", "");
-    PARM(double, kblur, "Blur constant", "0.95");
-    PARM(double, threshold, "Binarization threshold", "0.8");
-    PARM(int, sz, "Rectified cell size", "100");
-    PARM(int, maxerr, "Maximum error threshold", "50");
+struct Config {
+    std::string digits_name, bank_name, debug_name, binarized_name, binarized_dt_name, digits_dt_name, solver, dt_mode, results;
+    double kblur, threshold, input_scale, input_rotate, repair_cost;
+    int sz, maxerr, refine_steps, levels, match_threads, count_solutions, solver_threads, repair_candidates, repair_limit, repair_cells;
+};
 
-    parse_argv("sudoku", argc, argv);
+// Border kept around each digit in the bank
+const int bank_margin = 16;
+
+// Builds the template bank from the reference digits image
+std::vector<unsigned char> compileBank(const Config& cfg) {
+    auto org = loadImage<unsigned char>(cfg.digits_name);
+    Image<unsigned char> dtimg(org);
+    binarize(dtimg, cfg.kblur, cfg.threshold);
 
-    auto src = loadImage<unsigned char>(src_name);
+    Labeling blobs = label(dtimg, 0);
+    if (blobs.blobs.size() != 9) {
+        fprintf(stderr, "Digits sample doesn't have 9 digits. Aborting.\n");
+        exit(1);
+    }
 
-    auto org = src;
-    int w = src.w, h = src.h;
+    dt(dtimg);
+    if (cfg.digits_dt_name != "") saveImage(dtimg, cfg.digits_dt_name);
 
-    binarize(src, kblur, threshold);
+    // Storage for the patches and point lists until serialization
+    std::deque<Image<unsigned char>> images;
+    std::deque<std::vector<Pixel>> points;
+    auto patch = [&](Image<unsigned char> img, int x0, int y0) {
+        images.push_back(std::move(img));
+        Patch p;
+        p.x0 = x0; p.y0 = y0; p.w = images.back().w; p.h = images.back().h;
+        p.data = &images.back().data[0];
+        return p;
+    };
+    auto pointList = [&](const auto& pts) {
+        points.emplace_back(pts.begin(), pts.end());
+        return PointList{points.back().data(), int(points.back().size())};
+    };
 
-    std::vector<P> area;
-    int best = -1;
-    for (int y=0; y<h; y++) {
-        for (int x=0; x<w; x++) {
-            if (src(x, y) == 0) {
-                auto res = blob(src, x, y);
-                if (res.x0 > 0 && res.x1 < w && res.y0 > 0 && res.y1 < h) {
-                    int a = (res.x1 - res.x0)*(res.y1 - res.y0);
-                    if (a > best) {
-                        best = a;
-                        area = res.pts;
-                    }
+    const int m = bank_margin;
+    std::vector<DigitTemplate> digits;
+    for (int i=0; i<9; i++) {
+        const Blob& b = blobs.blobs[i];
+        int x0 = b.x0 - m, y0 = b.y0 - m, pw = b.x1 - b.x0 + 2*m, ph = b.y1 - b.y0 + 2*m;
+        DigitTemplate d{b.x0, b.y0, b.x1, b.y1,
+                        patch(crop(dtimg, x0, y0, pw, ph), x0, y0),
+                        patch(crop(org, x0, y0, pw, ph), x0, y0),
+                        pointList(blobs.pixels(i))};
+        digits.push_back(d);
+    }
+    return serializeBank(digits, m, cfg.kblur, cfg.threshold);
+}
+
+// Reference digits, loaded once and shared by all processed images: the bank
+// file when given, otherwise a bank compiled in memory from the digits image
+TemplateBank loadReference(const Config& cfg) {
+    if (cfg.bank_name == "") {
+        auto data = std::make_shared<std::vector<unsigned char>>(compileBank(cfg));
+        return parseBank(std::shared_ptr<const unsigned char>(data, data->data()), data->size());
+    }
+    TemplateBank bank = loadBank(cfg.bank_name);
+    if (bank.kblur != cfg.kblur || bank.threshold != cfg.threshold) {
+        fprintf(stderr, "Warning: template bank built with --kblur %g --threshold %g\n", bank.kblur, bank.threshold);
+    }
+    return bank;
+}
+
+typedef std::array<int, 81> Grid;
+
+struct Result {
+    enum Status { SOLVED, INVALID, FAIL } status;
+    Grid givens{}, solution{};          // the solution is all 0 when invalid
+    std::array<double, 81> errors{};    // match error of each recognized given
+    P corners[4] = {};                  // grid corners found in the image
+    long long solutions = 0, nodes = 0; // found (up to --count_solutions) and solver nodes
+    int unique = -1;                    // 1 or 0 when the solutions were counted
+    int repaired = 0;                   // givens changed by the OCR repair
+};
+
+// Parses the usual 81 characters one-line format
+bool parseGrid(const char *s, size_t n, int *data) {
+    if (n != 81) return false;
+    for (int i=0; i<81; i++) {
+        if (s[i] >= '1' && s[i] <= '9') {
+            data[i] = s[i] - '0';
+        } else if (s[i] == '.' || s[i] == '0') {
+            data[i] = 0;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string formatGrid(const Grid& data) {
+    std::string s;
+    for (int i=0; i<9; i++) {
+        for (int j=0; j<9; j++) {
+            s += ' ';
+            s += data[i*9+j] ? char('0' + data[i*9+j]) : '.';
+        }
+        s += '\n';
+    }
+    return s;
+}
+
+std::string formatResult(const Result& r) {
+    std::string s = formatGrid(r.givens) + "\n";
+    if (r.repaired) s += "Repaired " + std::to_string(r.repaired) + " givens (bad ocr)\n\n";
+    if (r.status == Result::INVALID) return s + "Invalid problem (bad ocr?)\n";
+    if (r.status == Result::FAIL) s += "** FAIL **\n\n";
+    s += formatGrid(r.solution);
+    if (r.unique == 1) s += "\nUnique solution\n";
+    if (r.unique == 0) s += "\n** NOT UNIQUE: " + std::to_string(r.solutions) + " solutions found **\n";
+    return s;
+}
+
+const char *statusName(Result::Status s) {
+    return s == Result::SOLVED ? "solved" : s == Result::INVALID ? "invalid" : "fail";
+}
+
+// 81 characters string
+std::string jsonGrid(const Grid& data) {
+    std::string s = "\"";
+    for (int v : data) s += v ? char('0' + v) : '.';
+    return s + "\"";
+}
+
+// Solution count and repair fields of a result
+std::string jsonCount(const Result& r) {
+    return ", \"solutions\": " + std::to_string(r.solutions) + ", \"unique\": " +
+        (r.unique < 0 ? "null" : r.unique ? "true" : "false") + ", \"nodes\": " + std::to_string(r.nodes) +
+        ", \"repaired\": " + std::to_string(r.repaired);
+}
+
+// Results only output (--results), one line per image:
+//   {"image": ..., "status": ..., "givens": "<81 chars>", "errors": [81 match
+//    errors, null for empty cells], "corners": [[x, y] top-left, top-right,
+//    bottom-left, bottom-right, null if not finite], "solution": "<81 chars>" or null, "solutions":
+//    found up to --count_solutions, "unique": true/false or null when not
+//    counted, "nodes": solver search nodes, "repaired": givens changed by
+//    the OCR repair}
+// and {"image": ..., "status": "error", "error": ...} when processing failed
+std::string resultJSON(const std::string& name, const Result *r, const std::string& error) {
+    std::string s = "{\"image\": " + jsonString(name) + ", \"status\": \"";
+    if (!r) return s + "error\", \"error\": " + jsonString(error) + "}\n";
+    char buf[64];
+    s += std::string(statusName(r->status)) + "\", \"givens\": " + jsonGrid(r->givens) + ", \"errors\": [";
+    for (int i=0; i<81; i++) {
+        if (r->givens[i]) snprintf(buf, sizeof(buf), "%s%.3f", i ? ", " : "", r->errors[i]);
+        else snprintf(buf, sizeof(buf), "%snull", i ? ", " : "");
+        s += buf;
+    }
+    s += "], \"corners\": [";
+    for (int i=0; i<4; i++) {
+        const P& c = r->corners[i];
+        if (std::isfinite(c.x) && std::isfinite(c.y)) snprintf(buf, sizeof(buf), "%s[%.2f, %.2f]", i ? ", " : "", c.x, c.y);
+        else snprintf(buf, sizeof(buf), "%snull", i ? ", " : "");
+        s += buf;
+    }
+    return s + "], \"solution\": " + (r->status == Result::INVALID ? "null" : jsonGrid(r->solution)) + jsonCount(*r) + "}\n";
+}
+
+// Binary results record, little endian and unaligned:
+//   char magic[4]                  "SDKR"
+//   uint32 size                    whole record
+//   uint8 status                   0 solved, 1 invalid, 2 fail, 3 error
+//   uint8 givens[81], solution[81] 0 for empty (the solution is all 0 unless
+//                                  solved or failed)
+//   float errors[81]               match errors, 0 for empty cells
+//   float corners[8]               x, y as in resultJSON()
+//   char name[]                    image name up to the end of the record
+std::string resultBinary(const std::string& name, const Result *r) {
+    std::string s(4 + 4 + 1 + 81 + 81 + 81*4 + 8*4, '\0');
+    memcpy(&s[0], "SDKR", 4);
+    s[8] = r ? char(r->status) : 3;
+    if (r) {
+        for (int i=0; i<81; i++) {
+            s[9 + i] = r->givens[i];
+            s[90 + i] = r->solution[i];
+            float e = r->givens[i] ? r->errors[i] : 0;
+            memcpy(&s[171 + i*4], &e, 4);
+        }
+        for (int i=0; i<4; i++) {
+            float c[2] = {float(r->corners[i].x), float(r->corners[i].y)};
+            memcpy(&s[495 + i*8], c, 8);
+        }
+    }
+    s += name;
+    uint32_t size = s.size();
+    memcpy(&s[4], &size, 4);
+    return s;
+}
+
+// Per-image profiles for --profile_name: one JSON document with an entry per
+// image in input order and their sum
+struct ProfileReport {
+    std::mutex m;
+    std::map<int, std::string> images;
+    Profile total;
+    std::vector<std::pair<std::string, std::vector<double>>> latencies;    // "total" and stages, seconds
+
+    void add(int index, const std::string& name, const char *status, const Profile& p) {
+        std::string s = "{\"image\": " + jsonString(name) + ", \"status\": \"" + status + "\", " + p.json() + "}";
+        std::lock_guard<std::mutex> lock(m);
+        images[index] = s;
+        total.add(p);
+        Profile::slot(latencies, "total").push_back(p.seconds);
+        for (auto& i : p.stages) Profile::slot(latencies, i.first).push_back(i.second);
+    }
+
+    // Mean, p50, p90, p99 and max of each latency in milliseconds (stages
+    // over the images that ran them)
+    std::vector<std::pair<std::string, std::array<double, 5>>> distributions() {
+        std::vector<std::pair<std::string, std::array<double, 5>>> res;
+        for (auto& i : latencies) {
+            std::vector<double> l = i.second;
+            std::sort(l.begin(), l.end());
+            auto pct = [&](double p) { return l[std::min(l.size()-1, size_t(p*l.size()))]*1e3; };
+            double sum = 0;
+            for (double x : l) sum += x;
+            res.emplace_back(i.first, std::array<double, 5>{sum/l.size()*1e3, pct(0.5), pct(0.9), pct(0.99), l.back()*1e3});
+        }
+        return res;
+    }
+
+    void write(const std::string& fname) {
+        std::string s = "{\"images\": [";
+        for (auto& i : images) s += (i.first == images.begin()->first ? "\n  " : ",\n  ") + i.second;
+        s += "],\n \"total\": {\"images\": " + std::to_string(total.runs) + ", " + total.json() + "},\n \"latency_ms\": {";
+        auto d = distributions();
+        for (size_t i=0; i<d.size(); i++) {
+            char buf[256];
+            snprintf(buf, sizeof(buf), "%s\"%s\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+                     i ? ",\n  " : "\n  ", d[i].first.c_str(), d[i].second[0], d[i].second[1], d[i].second[2],
+                     d[i].second[3], d[i].second[4]);
+            s += buf;
+        }
+        s += "}}\n";
+        writeFile(fname, std::vector<unsigned char>(s.begin(), s.end()));
+    }
+
+    // Latency table for the terminal
+    void print(FILE *f) {
+        fprintf(f, "%-12s %9s %9s %9s %9s %9s  (ms)\n", "stage", "mean", "p50", "p90", "p99", "max");
+        for (auto& i : distributions()) {
+            fprintf(f, "%-12s %9.3f %9.3f %9.3f %9.3f %9.3f\n", i.first.c_str(),
+                    i.second[0], i.second[1], i.second[2], i.second[3], i.second[4]);
+        }
+    }
+};
+
+// Writes per-item outputs completed out of order in their original order
+struct OrderedOutput {
+    FILE *f;
+    std::mutex m;
+    std::map<int, std::string> ready;
+    int next = 0;
+
+    OrderedOutput(FILE *f) : f(f) {}
+
+    void put(int index, std::string s) {
+        std::lock_guard<std::mutex> lock(m);
+        ready[index] = std::move(s);
+        for (auto it=ready.begin(); it!=ready.end() && it->first == next; it=ready.erase(it), next++) {
+            fwrite(it->second.data(), 1, it->second.size(), f);
+        }
+        fflush(f);
+    }
+};
+
+// Pixels of the grid outline: the largest blob (by bounding box) of black
+// pixels not touching the border of a binarized image, and the center of the
+// area it encloses
+static Scratch<Pixel> gridOutline(const Image<unsigned char>& bin, P& center) {
+    int w = bin.w, h = bin.h;
+    Scratch<Pixel> area;
+    {
+        Labeling blobs = label(bin, 0);
+        int best = -1, bi = -1;
+        for (int i=0; i<int(blobs.blobs.size()); i++) {
+            const Blob& res = blobs.blobs[i];
+            if (res.x0 > 0 && res.x1 < w && res.y0 > 0 && res.y1 < h) {
+                int a = (res.x1 - res.x0)*(res.y1 - res.y0);
+                if (a > best) {
+                    best = a;
+                    bi = i;
                 }
             }
         }
+        if (bi >= 0) area = blobs.pixels(bi);
     }
+    Image<unsigned char> src(w, h);
+    std::fill(src.data.begin(), src.data.end(), 1);
     for (auto& p : area) {
-        src[int(p.y)*w + int(p.x)] = 0xFE;
+        src[p.y*w + p.x] = 0xFE;
     }
     for (int y=0; y<h; y++) {
         for (int x=0; x<w && src(x, y) != 0xFE; x++) src(x, y, 0);
@@ -138,56 +859,378 @@ int main(int argc, const char *argv[]) {
         for (int y=0; y<h && src(x, y) != 0xFE; y++) src(x, y, 0);
         for (int y=h-1; y>=0 && src(x, y) != 0xFE; y--) src(x, y, 0);
     }
-
-    P center;
-    {
-        double cx = 0, cy = 0, sz = 0;
-        for (int y=0; y<h; y++) {
-            for (int x=0; x<w; x++) {
-                if (src[y*w+x]) {
-                    cx += x+0.5; cy += y+0.5; sz += 1;
-                }
+    double cx = 0, cy = 0, n = 0;
+    for (int y=0; y<h; y++) {
+        for (int x=0; x<w; x++) {
+            if (src[y*w+x]) {
+                cx += x+0.5; cy += y+0.5; n += 1;
             }
         }
-        center = P{cx/sz, cy/sz};
     }
+    center = P{cx/n, cy/n};
+    return area;
+}
 
-    auto farthest = [&](P a) -> P {
-                        double bd = 0;
-                        P res(a);
-                        for (auto& p : area) {
-                            double d2 = (p.x - a.x)*(p.x - a.x) + (p.y - a.y)*(p.y - a.y);
-                            if (d2 > bd) {
-                                bd = d2; res = p;
-                            }
-                        }
-                        return res;
-                 };
-
-    auto farthest2 = [&](P a, P b) -> P {
-                         double dx = b.x - a.x, dy = b.y - a.y, d2 = dx*dx + dy*dy;
-                         double bd = 0;
-                         P res(a);
-                         for (auto& p : area) {
-                             double t = std::max(0., std::min(1., ((p.x - a.x)*dx + (p.y - a.y)*dy)/d2));
-                             double xx = a.x + t*dx, yy = a.y + t*dy;
-                             double d = (xx - p.x)*(xx - p.x) + (yy - p.y)*(yy - p.y);
-                             if (d > bd) {
-                                 bd = d;
-                                 res = p;
-                             }
-                         }
-                         return res;
-                     };
+// Point of pts maximizing the distance from a
+static P farthest(const Scratch<P>& pts, P a) {
+    double bd = 0;
+    P res(a);
+    for (auto& p : pts) {
+        double d2 = (p.x - a.x)*(p.x - a.x) + (p.y - a.y)*(p.y - a.y);
+        if (d2 > bd) {
+            bd = d2; res = p;
+        }
+    }
+    return res;
+}
+
+// Point of pts maximizing the distance from segment a-b
+static P farthest2(const Scratch<P>& pts, P a, P b) {
+    double dx = b.x - a.x, dy = b.y - a.y, d2 = dx*dx + dy*dy;
+    double bd = 0;
+    P res(a);
+    for (auto& p : pts) {
+        double t = std::max(0., std::min(1., ((p.x - a.x)*dx + (p.y - a.y)*dy)/d2));
+        double xx = a.x + t*dx, yy = a.y + t*dy;
+        double d = (xx - p.x)*(xx - p.x) + (yy - p.y)*(yy - p.y);
+        if (d > bd) {
+            bd = d;
+            res = p;
+        }
+    }
+    return res;
+}
+
+// Number of pyramid levels for grid detection: -1 halves the image until
+// its longest side is at most 1024 pixels
+static int gridLevels(const Config& cfg, int w, int h) {
+    if (cfg.levels >= 0) return cfg.levels;
+    int levels = 0;
+    while (std::max(w, h) >> levels > 1024) levels++;
+    return levels;
+}
 
-    P A = farthest(center), D = farthest(A), B = farthest2(A, D), C = farthest(B);
+// Outer corners of the grid: A top-left, B top-right, C bottom-left, D
+// bottom-right. The outline is searched on a coarse pyramid level; every
+// corner is then found again at full resolution among the outline pixels
+// in a small window around its coarse position. Returns false when the image
+// has no outline.
+bool gridCorners(const ImageView<unsigned char>& img, const Config& cfg, P& A, P& B, P& C, P& D) {
+    Stage stage("grid");
+    int levels = gridLevels(cfg, img.w, img.h);
+    Scratch<Image<unsigned char>> levs;
+    {
+        Stage stage("pyramid");
+        levs = pyramid(img, levels);
+    }
+    levels = levs.size();
+    Image<unsigned char> bin = levels ? std::move(levs.back()) : Image<unsigned char>(img);
+    levs.clear();
+    // One coarse pixel spans 2^levels source pixels
+    int s = 1 << levels;
+    binarize(bin, pow(cfg.kblur, s), cfg.threshold);
+
+    P center;
+    Scratch<Pixel> area = gridOutline(bin, center);
+    if (area.empty()) return false;
+    Scratch<P> pts;
+    for (auto& q : area) pts.push_back(P{(q.x+0.5)*s, (q.y+0.5)*s});
+    center = P{center.x*s, center.y*s};
+
+    A = farthest(pts, center), D = farthest(pts, A), B = farthest2(pts, A, D), C = farthest(pts, B);
+    if (levels) {
+        Image<unsigned char> mask(bin.w, bin.h);
+        for (auto& q : area) mask(q.x, q.y, 1);
+        // Outline pixels within r of a coarse corner, from the components of
+        // a binarized crop (with a margin for the blur) that touch the coarse
+        // outline
+        int r = 2*s + 2, m = int(10/(1 - cfg.kblur));
+        auto window = [&](P c) {
+            int cx = c.x, cy = c.y,
+                x0 = std::max(0, cx - r - m), x1 = std::min(img.w, cx + r + m + 1),
+                y0 = std::max(0, cy - r - m), y1 = std::min(img.h, cy + r + m + 1);
+            Image<unsigned char> win = crop(img, x0, y0, x1 - x0, y1 - y0);
+            binarize(win, cfg.kblur, cfg.threshold);
+            Labeling blobs = label(win, 0);
+            Scratch<P> res;
+            for (int i=0; i<int(blobs.blobs.size()); i++) {
+                Scratch<Pixel> px = blobs.pixels(i);
+                bool outline = false;
+                for (auto& q : px) {
+                    if (mask((x0 + q.x)/s, (y0 + q.y)/s)) {
+                        outline = true;
+                        break;
+                    }
+                }
+                if (!outline) continue;
+                for (auto& q : px) {
+                    int x = x0 + q.x, y = y0 + q.y;
+                    if (abs(x - cx) <= r && abs(y - cy) <= r) res.push_back(P{x+0.5, y+0.5});
+                }
+            }
+            return res;
+        };
+        // a corner with no outline pixels around it keeps the coarse estimate
+        Scratch<P> wa = window(A), wd = window(D), wb = window(B), wc = window(C);
+        if (wa.size()) A = farthest(wa, center);
+        if (wd.size()) D = farthest(wd, A);
+        if (wb.size()) B = farthest2(wb, A, D);
+        if (wc.size()) C = farthest(wc, B);
+    }
     if (A.y > D.y) std::swap(A, D);
     if (B.y > C.y) std::swap(B, C);
     if (A.x > B.x) { std::swap(A, B); std::swap(C, D); }
+    return true;
+}
+
+// Solved grids by givens, solver and solution limit, shared by all threads
+struct SolvedGrid {
+    Result::Status status;
+    Grid solution;
+    long long solutions, nodes;
+};
 
-    std::vector<double> mat{ (B.x-A.x),   (B.y-A.y),   0.,
-                             (C.x-A.x),   (C.y-A.y),   0.,
-                             A.x,         A.y,         1., };
+static LRUCache<SolvedGrid>& solved_grids() {
+    static LRUCache<SolvedGrid> cache;
+    return cache;
+}
+
+// Helpers of the solver when counting solutions, null when serial
+static std::unique_ptr<ThreadPool>& solver_workers() {
+    static std::unique_ptr<ThreadPool> pool;
+    return pool;
+}
+
+// Solves r.givens into r.solution with the configured solver (counting the
+// solutions up to --count_solutions), or takes the result from the cache
+// when the same givens were solved before
+void solveGrid(const Config& cfg, Result& r, SolverStats& stats) {
+    Stage stage("solve");
+    r.solution = r.givens;
+    r.solutions = r.nodes = 0;
+    r.unique = -1;
+    if (!validGrid(&r.solution[0])) {
+        r.solution = Grid{};
+        r.status = Result::INVALID;
+        return;
+    }
+    LRUCache<SolvedGrid>& cache = solved_grids();
+    CacheKey key{0, 0};
+    SolvedGrid sg;
+    bool hit = false;
+    if (cache.capacity()) {
+        Hasher hs;
+        hs.add(r.givens);
+        hs.add(cfg.count_solutions);
+        hs.bytes(cfg.solver.data(), cfg.solver.size());
+        key = hs.key();
+        hit = cache.get(key, sg);
+        profileCount(hit ? "grid_hits" : "grid_misses", 1);
+    }
+    if (!hit) {
+        // nodes of this search only, stats may already count earlier ones
+        const Solver& solver = solverNamed(cfg.solver);
+        SolverStats own;
+        if (cfg.count_solutions == 1) {
+            sg.solutions = solver.solve(&r.solution[0], own);
+        } else {
+            sg.solutions = solver.count(&r.solution[0], cfg.count_solutions, solver_workers().get(), own);
+        }
+        stats.nodes += own.nodes;
+        stats.backtracks += own.backtracks;
+        sg.status = sg.solutions ? Result::SOLVED : Result::FAIL;
+        sg.solution = r.solution;
+        sg.nodes = own.nodes;
+        cache.put(key, sg);
+    }
+    r.status = sg.status;
+    r.solution = sg.solution;
+    r.solutions = sg.solutions;
+    r.nodes = sg.nodes;
+    if (cfg.count_solutions != 1 && sg.solutions) r.unique = sg.solutions == 1;
+}
+
+// Alternatives of a recognized given for repairGrid(): digits (0 = no
+// digit, the blob wasn't one) with their match errors, the recognized one
+// first and the others by increasing error
+struct CellOptions {
+    int cell, n;
+    std::array<int, 10> digit;
+    std::array<double, 10> err;
+};
+
+// Options of a given from the errors of every digit at its blob: the
+// recognized digit, up to k-1 other digits below maxerr and no digit, which
+// costs maxerr
+CellOptions cellOptions(int cell, int given, const double *err, int k, double maxerr) {
+    CellOptions c{cell, 1, {{given}}, {{err[given-1]}}};
+    for (int d=1; d<=9; d++) {
+        if (d == given || !(err[d-1] < maxerr)) continue;
+        int i = c.n++;
+        for (; i > 1 && c.err[i-1] > err[d-1]; i--) {
+            c.digit[i] = c.digit[i-1];
+            c.err[i] = c.err[i-1];
+        }
+        c.digit[i] = d;
+        c.err[i] = err[d-1];
+    }
+    c.n = std::min(c.n, std::max(1, k));
+    c.digit[c.n] = 0;
+    c.err[c.n++] = maxerr;
+    return c;
+}
+
+// OCR repair of givens that are invalid or have no solution: assignments of
+// the cells options are tried in increasing total match error and the
+// first one that is valid with a unique solution replaces the givens. Each
+// assignment is generated once, from the one with the option of its last
+// changed cell one step back (or that cell unchanged), so its descendants
+// only change that cell and the ones after it: when the cells before it
+// already conflict (the row, column and box masks of validGrid()) nothing
+// below can be valid and the whole subtree is skipped. Cells in conflict
+// come first so that happens early. At most --repair_limit assignments are
+// checked, changing up to --repair_cells givens and adding up to
+// --repair_cost to their match errors (a misread digit is close to the
+// right one, many small changes fit some other puzzle); false when none was
+// found.
+bool repairGrid(const Config& cfg, Result& r, Scratch<CellOptions>& cells, SolverStats& stats) {
+    int n = cells.size();
+    if (!n) return false;
+    bool conflict[81] = {};
+    for (auto& a : cells) {
+        for (auto& b : cells) {
+            int i = a.cell, j = b.cell;
+            bool peers = i/9 == j/9 || i%9 == j%9 || (i/27 == j/27 && i%9/3 == j%9/3);
+            if (i != j && peers && a.digit[0] == b.digit[0]) conflict[i] = true;
+        }
+    }
+    Scratch<CellOptions> ordered;
+    ordered.reserve(n);
+    for (auto& c : cells) if (conflict[c.cell]) ordered.push_back(c);
+    for (auto& c : cells) if (!conflict[c.cell]) ordered.push_back(c);
+    cells.swap(ordered);
+
+    struct Node {
+        double cost;            // extra error over the recognized givens
+        int id, last;           // options in pool[id*n...], last changed cell
+        int changed;            // cells not at their recognized digit
+    };
+    auto later = [](const Node& a, const Node& b) { return a.cost > b.cost || (a.cost == b.cost && a.id > b.id); };
+    std::priority_queue<Node, Scratch<Node>, decltype(later)> queue(later);
+    Scratch<unsigned char> pool(n, 0), cur(n);
+    queue.push(Node{0, 0, -1, 0});
+    const Solver& solver = solverNamed(cfg.solver);
+    for (int tried=0; queue.size() && tried < cfg.repair_limit; ) {
+        Node node = queue.top();
+        queue.pop();
+        std::copy(&pool[size_t(node.id)*n], &pool[size_t(node.id)*n] + n, cur.begin());
+        Grid grid = r.givens;
+        for (int c=0; c<n; c++) grid[cells[c].cell] = cells[c].digit[cur[c]];
+        unsigned used[27] = {};
+        bool fixed = false;
+        for (int c=0; c<node.last && !fixed; c++) {
+            int i = cells[c].cell, d = grid[i];
+            if (!d) continue;
+            int m = 1 << (d-1), u[3] = {i/9, 9 + i%9, 18 + i/27*3 + i%9/3};
+            fixed = (used[u[0]] | used[u[1]] | used[u[2]]) & m;
+            for (int k : u) used[k] |= m;
+        }
+        if (fixed) continue;
+        if (node.last >= 0) {
+            tried++;
+            profileCount("repairs", 1);
+            Grid g = grid;
+            if (validGrid(&g[0]) && solver.count(&g[0], 2, nullptr, stats) == 1) {
+                int changed = 0;
+                for (int c=0; c<n; c++) {
+                    if (cur[c]) {
+                        const CellOptions& o = cells[c];
+                        r.givens[o.cell] = o.digit[cur[c]];
+                        r.errors[o.cell] = o.digit[cur[c]] ? o.err[cur[c]] : 0;
+                        changed++;
+                    }
+                }
+                solveGrid(cfg, r, stats);
+                r.repaired = changed;
+                return true;
+            }
+        }
+        auto push = [&](int c, int last) {
+                        int id = pool.size() / n, o = cur[c] + 1, changed = node.changed + (o == 1);
+                        double cost = node.cost + cells[c].err[o] - cells[c].err[o-1];
+                        if (cost > cfg.repair_cost || changed > cfg.repair_cells) return;
+                        pool.insert(pool.end(), cur.begin(), cur.end());
+                        pool[size_t(id)*n + c] = o;
+                        queue.push(Node{cost, id, last, changed});
+                    };
+        if (node.last >= 0 && cur[node.last] + 1 < cells[node.last].n) push(node.last, node.last);
+        for (int c=node.last+1; c<n && node.changed < cfg.repair_cells; c++) push(c, c);
+    }
+    return false;
+}
+
+// Cache file: "SDKCACHE", version, the solved grids, then the bank and
+// cell size the cell matches were made with and the matches, which are
+// kept only when they're the current ones. A missing file is an empty
+// cache. Entries are raw SolvedGrid and Match structs: bump the version
+// whenever either changes layout or meaning (3: SolvedGrid::nodes counts
+// only the search of its own givens).
+const uint32_t CACHE_VERSION = 3;
+
+void loadCaches(const std::string& fname, const ChamferMatcher& ref) {
+    FILE *f = fopen(fname.c_str(), "rb");
+    if (!f) return;
+    std::shared_ptr<FILE> closer(f, fclose);
+    char magic[8];
+    uint32_t version;
+    if (fread(magic, 8, 1, f) != 1 || memcmp(magic, "SDKCACHE", 8) != 0) {
+        throw std::runtime_error("'" + fname + "' is not a cache file");
+    }
+    if (fread(&version, sizeof(version), 1, f) != 1 || version != CACHE_VERSION) return;
+    CacheKey context;
+    if (solved_grids().load(f) && fread(&context, sizeof(context), 1, f) == 1 && context == ref.context()) {
+        ref.cells.load(f);
+    }
+    solved_grids().hits = solved_grids().misses = 0;
+    ref.cells.hits = ref.cells.misses = 0;
+}
+
+// Written to a temporary file renamed over the old one
+void saveCaches(const std::string& fname, const ChamferMatcher& ref) {
+    std::string tmp = fname + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) throw std::runtime_error("Error writing cache file '" + tmp + "'");
+    fwrite("SDKCACHE", 8, 1, f);
+    fwrite(&CACHE_VERSION, sizeof(CACHE_VERSION), 1, f);
+    solved_grids().save(f);
+    CacheKey context = ref.context();
+    fwrite(&context, sizeof(context), 1, f);
+    ref.cells.save(f);
+    bool ok = !ferror(f);
+    if (fclose(f) != 0 || !ok || rename(tmp.c_str(), fname.c_str()) != 0) {
+        remove(tmp.c_str());
+        throw std::runtime_error("Error writing cache file '" + fname + "'");
+    }
+}
+
+Result processImage(const Config& cfg, const ChamferMatcher& ref,
+                    const ImageView<unsigned char>& org, const std::string& output_name) {
+    const double kblur = cfg.kblur, threshold = cfg.threshold;
+    const int sz = cfg.sz, maxerr = cfg.maxerr;
+    const std::vector<DigitTemplate>& digits = ref.bank.digits;
+    auto save = [](const auto& img, const std::string& name) {
+                    if (name != "") {
+                        Stage stage("save");
+                        saveImage(img, name);
+                    }
+                };
+
+    profileCount("pixels", (long long)org.w*org.h);
+
+    P A, B, C, D;
+    if (!gridCorners(org, cfg, A, B, C, D)) throw ImageError("No grid found");
+
+    std::array<double, 9> mat = squareToQuad(A, B, C, D);
     auto project = [&](double x, double y) -> P {
                        double iz = mat[2]*x + mat[5]*y + mat[8];
                        double ix = mat[0]*x + mat[3]*y + mat[6];
@@ -205,151 +1248,181 @@ int main(int argc, const char *argv[]) {
                                    (C.x-c.x)*(C.x-c.x) + (C.y-c.y)*(C.y-c.y) +
                                    (D.x-d.x)*(D.x-d.x) + (D.y-d.y)*(D.y-d.y));
                        };
-    double be = project_err();
-    for (int count=0; count<1000000; count++) {
-        auto old = mat;
-        for (int i=3; i>=0; i--) {
-            mat[rnd(9)] += (rnd()-0.5)*rnd()*rnd();
-        }
-        mat[8] = 1.;
-        double e = project_err();
-        if (e < be) {
-            be = e;
-        } else {
-            mat = old;
+    // Optional random-walk refinement of the closed form solution
+    {
+        Stage stage("fit");
+        double be = project_err();
+        for (int count=0; count<cfg.refine_steps; count++) {
+            auto old = mat;
+            for (int i=3; i>=0; i--) {
+                mat[rnd(9)] += (rnd()-0.5)*rnd()*rnd();
+            }
+            mat[8] = 1.;
+            double e = project_err();
+            if (e < be) {
+                be = e;
+            } else {
+                mat = old;
+            }
         }
     }
 
     Image<unsigned char> rectified(sz*11, sz*11);
-    for (int y=-sz; y<sz*10; y++) {
-        double s = (y+0.5)/(sz*9);
-        for (int x=-sz; x<sz*10; x++) {
-            double t = (x+0.5)/(sz*9);
-            P p = project(t, s);
-            rectified(x+sz, y+sz, std::max(0, std::min(255, int(bili(org, p.x, p.y)))));
-        }
+    {
+        Stage stage("rectify");
+        // pixel x maps to (x - sz + 0.5)/(9*sz) in the unit square
+        double k = 1./(sz*9), o = (0.5 - sz)*k;
+        warp(org, rectified, pixelMap(mat, k, o, k, o));
     }
     auto binr(rectified);
     binarize(binr, kblur, threshold);
-    if (binarized_name != "") saveImage(binr, binarized_name);
+    save(binr, cfg.binarized_name);
 
-    auto digits_image = loadImage<unsigned char>(digits_name);
-    auto org_digits_image(digits_image);
-    binarize(digits_image, kblur, threshold);
+    // The euclid transform is matched at 16 bits, binr gets it saturated
+    Image<unsigned short> dtw(0, 0);
+    if (cfg.dt_mode == "euclid") {
+        dtw = dtEuclid(binr);
+        for (int i=0; i<binr.w*binr.h; i++) binr[i] = std::min(255, int(dtw[i]));
+    } else if (cfg.dt_mode == "reference") {
+        dtReference(binr);
+    } else {
+        dt(binr);
+    }
+    save(binr, cfg.binarized_dt_name);
 
-    std::vector<Blob> digits;
-    for (int y=0; y<digits_image.h; y++) {
-        for (int x=0; x<digits_image.w; x++) {
-            if (digits_image(x, y) == 0) {
-                digits.push_back(blob(digits_image, x, y));
-            }
+    // Nothing is rendered in results only mode
+    const bool render = cfg.results == "", debugging = cfg.debug_name != "";
+    Image<unsigned> debug(debugging ? rectified.w : 0, debugging ? rectified.h : 0);
+
+    Grid data{};
+    std::array<double, 81> errors{};
+    Image<unsigned> out(render ? org.w : 0, render ? org.h : 0);
+    if (render) {
+        Stage stage("show");
+        for (int y=0; y<org.h; y++) {
+            const unsigned char *src = org.row(y);
+            unsigned *dst = &out.data[size_t(y)*org.w];
+            for (int x=0; x<org.w; x++) dst[x] = src[x]*3/4*0x010101;
         }
     }
-    if (digits.size() != 9) {
-        fprintf(stderr, "Digits sample doesn't have 9 digits. Aborting.\n");
-        exit(1);
-    }
 
-    dt(digits_image);
-    dt(binr);
-    if (digits_dt_name != "") saveImage(digits_image, digits_dt_name);
-    if (binarized_dt_name != "") saveImage(binr, binarized_dt_name);
-
-    Image<unsigned> debug(rectified.w, rectified.h);
-
-    std::vector<int> data(9*9);
-    Image<unsigned> out(org.w, org.h);
-    for (int i=0; i<org.w*org.h; i++) out[i] = org[i]*3/4*0x010101;
-
-    auto show = [&](int ii, int jj, int d, unsigned color) {
-                    std::vector<int> aa(org.w*org.h*2);
-                    Blob& dd = digits[d];
-                    for (int y=0; y<sz; y++) {
-                        for (int x=0; x<sz; x++) {
-                            double j = double(x) / sz / 9;
-                            double i = double(y) / sz / 9;
-                            P p = project(jj/9.+0.5/9+(j-0.5/9)*0.5, ii/9.+0.5/9+(i-0.5/9)*0.6);
-                            int ix = p.x, iy = p.y;
-                            if (ix >=0 && ix < org.w && iy >= 0 && iy < org.h) {
-                                double s = (y+0.5)/sz, t = (x+0.5)/sz;
-                                double xx = dd.x0*(1-t)+dd.x1*t, yy = dd.y0*(1-s)+dd.y1*s;
-                                int a = (iy*org.w + ix)*2;
-                                aa[a] += bili(org_digits_image, xx, yy);
-                                aa[a+1] += 1;
+    // Digits to overlay on the output, in cell (ii, jj); showDigits()
+    // composites the queued ones in order. Each digit is accumulated only
+    // over the bounding box of its projected pixels, in scratch buffers
+    // reused for all of them.
+    struct Shown { int ii, jj, d; unsigned color; };
+    Scratch<Shown> shown;
+    Scratch<int> pos(sz*sz), aa;
+    auto showDigits = [&]() {
+                    Stage stage("show");
+                    for (auto& sd : shown) {
+                        const DigitTemplate& dd = digits[sd.d];
+                        unsigned color = sd.color;
+                        // the digit covers the middle half (x) and 60% (y) of the cell
+                        auto m = pixelMap(mat, 0.5/(sz*9), (sd.jj + 0.25)/9, 0.6/(sz*9), (sd.ii + 0.2)/9);
+                        int x0 = org.w, y0 = org.h, x1 = -1, y1 = -1;
+                        for (int y=0; y<sz; y++) {
+                            double X = m[3]*y + m[6], Y = m[4]*y + m[7], Z = m[5]*y + m[8];
+                            for (int x=0; x<sz; x++, X+=m[0], Y+=m[1], Z+=m[2]) {
+                                int ix = X/(Z + !Z), iy = Y/(Z + !Z);
+                                if (ix >=0 && ix < org.w && iy >= 0 && iy < org.h) {
+                                    pos[y*sz + x] = iy*org.w + ix;
+                                    x0 = std::min(x0, ix); x1 = std::max(x1, ix);
+                                    y0 = std::min(y0, iy); y1 = std::max(y1, iy);
+                                } else {
+                                    pos[y*sz + x] = -1;
+                                }
                             }
                         }
-                    }
-                    for (int i=0; i<org.w*org.h; i++) {
-                        if (aa[i*2+1]) {
-                            int r = (out[i] & (color*255))/color;
-                            int ov = 255 - aa[i*2] / aa[i*2+1];
-                            out[i] = (out[i] & (color*255 ^ 0xFFFFFF)) + std::min(255, r + ov)*color;
-                        }
-                    }
-                };
-
-    for (int y=0; y<rectified.h; y++) {
-        for (int x=0; x<rectified.w; x++) {
-            if (binr(x, y) == 0) {
-                auto res = blob(binr, x, y);
-                int bw = res.x1 - res.x0, bh = res.y1 - res.y0;
-                if (bh > sz/3 && bh < sz && bw > sz/8 && bw < sz) {
-                    int be = 0, bd = -1;
-                    int x0 = res.x0-sz/8, x1 = res.x1 + sz/8,
-                        y0 = res.y0-sz/8, y1 = res.y1 + sz/8;
-                    for (int d=0; d<9; d++) {
-                        for (int tx=-1; tx<=1; tx++) {
-                            for (int ty=-1; ty<=1; ty++) {
-                                Blob& dd = digits[d];
-                                double sf = double(dd.y1 - dd.y0)/(res.y1 - res.y0);
-                                double rx = (res.x0 + res.x1)*0.5 + 0.5;
-                                double ry = (res.y0 + res.y1)*0.5 + 0.5;
-                                double dx = (dd.x0 + dd.x1)*0.5 + 0.5;
-                                double dy = (dd.y0 + dd.y1)*0.5 + 0.5;
-                                double e = 0, n = 0;
-                                for (auto& p : res.pts) {
-                                    int x = p.x+tx, y = p.y+ty;
-                                    e += digits_image((x-rx)*sf+dx, (y-ry)*sf+dy);
-                                    n += 1;
-                                }
-                                for (auto& p : dd.pts) {
-                                    int x = p.x, y = p.y;
-                                    e += binr((x-dx)/sf+rx+tx, (y-dy)/sf+ry+ty);
-                                    n += 1;
-                                }
-                                e /= n;
-                                if (bd == -1 || e < be) {
-                                    be = e; bd = d;
+                        if (x1 < 0) continue;
+                        int bw = x1 - x0 + 1, bh = y1 - y0 + 1;
+                        aa.assign(size_t(bw)*bh*2, 0);
+                        for (int y=0; y<sz; y++) {
+                            for (int x=0; x<sz; x++) {
+                                int i = pos[y*sz + x];
+                                if (i >= 0) {
+                                    double s = (y+0.5)/sz, t = (x+0.5)/sz;
+                                    double xx = dd.x0*(1-t)+dd.x1*t, yy = dd.y0*(1-s)+dd.y1*s;
+                                    int a = ((i/org.w - y0)*bw + i%org.w - x0)*2;
+                                    aa[a] += dd.gray.bili(xx, yy);
+                                    aa[a+1] += 1;
                                 }
                             }
                         }
-                    }
-                    if (be < maxerr) {
-                        Blob& dd = digits[bd];
-                        double sf = double(dd.y1 - dd.y0)/(res.y1 - res.y0);
-                        double rx = (res.x0 + res.x1)*0.5 + 0.5;
-                        double ry = (res.y0 + res.y1)*0.5 + 0.5;
-                        double dx = (dd.x0 + dd.x1)*0.5 + 0.5;
-                        double dy = (dd.y0 + dd.y1)*0.5 + 0.5;
-                        for (int y=y0; y<y1; y++) {
-                            for (int x=x0; x<x1; x++) {
-                                int ref = digits_image((x-rx)*sf+dx, (y-ry)*sf+dy);
-                                int v = (x<res.x0 || x>=res.x1 || y<res.y0 || y>=res.y1) ? 255 : binr(x, y);
-                                debug(x, y, v*0x010000 + (255-ref)*0x000100);
+                        for (int y=0; y<bh; y++) {
+                            for (int x=0; x<bw; x++) {
+                                int a = (y*bw + x)*2, i = (y0 + y)*org.w + x0 + x;
+                                if (aa[a+1]) {
+                                    int r = (out[i] & (color*255))/color;
+                                    int ov = 255 - aa[a] / aa[a+1];
+                                    out[i] = (out[i] & (color*255 ^ 0xFFFFFF)) + std::min(255, r + ov)*color;
+                                }
                             }
                         }
-
-                        int i = int(ry / sz) - 1, j = int(rx / sz) - 1;
-                        if (i >= 0 && i < 9 && j >= 0 && j < 9) {
-                            data[i*9 + j] = bd+1;
-                            show(i, j, bd, 0x010000);
-                        }
                     }
+                    shown.clear();
+                };
+
+    PaddedImage<unsigned char> dtpad;
+    PaddedImage<unsigned short> dtpadw;
+    if (dtw.w) {
+        dtpadw = ref.pad_image(dtw);
+    } else {
+        dtpad = ref.pad_image(binr);
+    }
+    Labeling blobs = label(binr, 0);
+    Scratch<Blob> cands;
+    for (int bi=0; bi<int(blobs.blobs.size()); bi++) {
+        const Blob& box = blobs.blobs[bi];
+        int bw = box.x1 - box.x0, bh = box.y1 - box.y0;
+        if (bh > sz/3 && bh < sz && bw > sz/8 && bw < sz) {
+            profileCount("candidates", 1);
+            cands.push_back(blobs.blob(bi));
+        }
+    }
+    Scratch<Match> found(cands.size());
+    int source[81];                             // candidate of each given
+    {
+        Stage stage("match");
+        if (dtw.w) {
+            ref.match(dtpadw, cands.data(), cands.size(), maxerr, found.data());
+        } else {
+            ref.match(dtpad, cands.data(), cands.size(), maxerr, found.data());
+        }
+    }
+    for (size_t k=0; k<cands.size(); k++) {
+        const Blob& res = cands[k];
+        const Match& best = found[k];
+        int x0 = res.x0-sz/8, x1 = res.x1 + sz/8,
+            y0 = res.y0-sz/8, y1 = res.y1 + sz/8;
+        int bd = best.digit;
+        if (bd >= 0) {
+            const DigitTemplate& dd = digits[bd];
+            double sf = double(dd.y1 - dd.y0)/(res.y1 - res.y0);
+            double rx = (res.x0 + res.x1)*0.5 + 0.5;
+            double ry = (res.y0 + res.y1)*0.5 + 0.5;
+            double dx = (dd.x0 + dd.x1)*0.5 + 0.5;
+            double dy = (dd.y0 + dd.y1)*0.5 + 0.5;
+            for (int y=y0; debugging && y<y1; y++) {
+                for (int x=x0; x<x1; x++) {
+                    int ref = dd.dt((x-rx)*sf+dx, (y-ry)*sf+dy);
+                    int v = (x<res.x0 || x>=res.x1 || y<res.y0 || y>=res.y1) ? 255 : binr(x, y);
+                    debug(x, y, v*0x010000 + (255-ref)*0x000100);
                 }
             }
+
+            int i = int(ry / sz) - 1, j = int(rx / sz) - 1;
+            if (i >= 0 && i < 9 && j >= 0 && j < 9) {
+                data[i*9 + j] = bd+1;
+                errors[i*9 + j] = best.err;
+                source[i*9 + j] = k;
+                profileCount("digits", 1);
+                if (render) shown.push_back(Shown{i, j, bd, 0x010000});
+            }
         }
     }
     auto line = [&](P a, P b, unsigned color) {
+                    Stage stage("show");
                     int x0 = a.x, y0 = a.y, x1 = b.x, y1 = b.y;
                     int ix = x0 < x1 ? 1 : -1, dx = abs(x1 - x0);
                     int iy = y0 < y1 ? 1 : -1, dy = abs(y1 - y0);
@@ -360,112 +1433,752 @@ int main(int argc, const char *argv[]) {
                         if ((cy += dy) >= m) { cy -= m; y0 += iy; }
                     }
                 };
-    for (int i=0; i<=9; i++) {
+    for (int i=0; render && i<=9; i++) {
         line(project(0, i/9.), project(1, i/9.), 0xFF00FF);
         line(project(i/9., 0), project(i/9., 1), 0xFF00FF);
     }
 
-    if (debug_name != "") saveImage(debug, debug_name);
+    save(debug, cfg.debug_name);
+
+    Result result{Result::SOLVED, data, {}, errors, {A, B, C, D}};
+    SolverStats stats;
+    if (validGrid(&data[0])) {
+        solveGrid(cfg, result, stats);
+    } else {
+        result.status = Result::INVALID;
+    }
+    if (result.status != Result::SOLVED && cfg.repair_limit > 0) {
+        Stage stage("repair");
+        Scratch<CellOptions> options;
+        for (int i=0; i<81; i++) {
+            if (data[i]) {
+                double err[9];
+                if (dtw.w) {
+                    ref.digitErrors(dtpadw, cands[source[i]], maxerr, err);
+                } else {
+                    ref.digitErrors(dtpad, cands[source[i]], maxerr, err);
+                }
+                options.push_back(cellOptions(i, data[i], err, cfg.repair_candidates, maxerr));
+            }
+        }
+        repairGrid(cfg, result, options, stats);
+    }
+    profileCount("nodes", stats.nodes);
+    profileCount("backtracks", stats.backtracks);
+
+    // Recognized digits, or the givens as repaired, and the solution in the
+    // cells empty in the image (not over the blob of a removed given)
+    if (result.repaired) {
+        shown.clear();
+        for (int i=0; render && i<81; i++) {
+            if (result.givens[i]) shown.push_back(Shown{i/9, i%9, result.givens[i]-1, 0x010000});
+        }
+    }
+    for (int i=0; render && result.status != Result::INVALID && i<81; i++) {
+        int d = result.solution[i];
+        if (d && !data[i]) shown.push_back(Shown{i/9, i%9, d-1, 0x000100});
+    }
+    showDigits();
+    if (render) save(out, output_name);
 
-    // Backtracking solver
+    return result;
+}
 
-    for (int i=0; i<9; i++) {
-        for (int j=0; j<9; j++) {
-            if (data[i*9+j]) {
-                printf(" %i", data[i*9+j]);
-            } else {
-                printf(" .");
+Result processImage(const Config& cfg, const ChamferMatcher& ref,
+                    const std::string& src_name, const std::string& output_name) {
+    // Binary PGM files are processed in place in their mapping
+    MappedImage org;
+    {
+        Stage stage("load");
+        org = mapImage(src_name);
+    }
+    if (cfg.input_scale != 1 || cfg.input_rotate != 0) {
+        Image<unsigned char> img = transformed(org.view, cfg.input_scale, cfg.input_rotate);
+        return processImage(cfg, ref, img, output_name);
+    }
+    return processImage(cfg, ref, org.view, output_name);
+}
+
+// Sequence mode frames: binary PGM/PPM files concatenated in a stream ("-"
+// for stdin), or numbered files named by a pattern with one %d (optionally
+// zero padded, %04d) starting at 0 or 1
+struct FrameSource {
+    std::string pattern;
+    FILE *f = nullptr;
+    int index = 0;
+
+    FrameSource(const std::string& name) {
+        size_t i = name.find('%');
+        if (i != std::string::npos) {
+            size_t j = name.find_first_not_of("0123456789", i+1);
+            if (j == std::string::npos || name[j] != 'd' || name.find('%', j) != std::string::npos) {
+                throw std::runtime_error("Invalid frame name pattern '" + name + "'");
+            }
+            pattern = name;
+            if (access(frameName(0).c_str(), R_OK) != 0) index = 1;
+        } else {
+            f = name == "-" ? stdin : fopen(name.c_str(), "rb");
+            if (!f) {
+                perror("frames_name");
+                exit(1);
             }
         }
-        printf("\n");
     }
-    printf("\n");
 
-    std::vector<unsigned> used(9+9+9);
-    auto data0 = data;
+    ~FrameSource() {
+        if (f && f != stdin) fclose(f);
+    }
 
-    for (int i=0; i<9; i++) {
-        for (int j=0; j<9; j++) {
-            if (data[i*9+j]) {
-                int m = 1 << (data[i*9+j] - 1), b = i/3*3 + j/3;
-                if ((used[i] | used[9+j] | used[18+b]) & m) {
-                    saveImage(out, output_name);
-                    printf("Invalid problem (bad ocr?)\n");
-                    exit(1);
+    std::string frameName(int i) const {
+        char buf[4096];
+        snprintf(buf, sizeof(buf), pattern.c_str(), i);
+        return buf;
+    }
+
+    // Next frame, false at the end of the sequence. Stream frames are read
+    // into buf, 8-bit PGM ones are then viewed in place.
+    bool next(MappedImage& img, Scratch<unsigned char>& buf, std::string& name) {
+        if (!f) {
+            name = frameName(index++);
+            if (access(name.c_str(), R_OK) != 0) return false;
+            img = mapImage(name);
+            return true;
+        }
+        if (!readPNM(f, buf)) return false;
+        name = "frame " + std::to_string(index++);
+        PNMHeader hd = parsePNMHeader(buf.data(), buf.size());
+        if (hd.channels == 1 && hd.maxval == 255) {
+            img.view = ImageView<unsigned char>(buf.data() + hd.offset, hd.w, hd.h, hd.w);
+        } else {
+            img.decoded = decodeImage<unsigned char>(buf.data(), buf.size());
+            img.view = img.decoded;
+        }
+        return true;
+    }
+};
+
+// Sequence mode state: the frames come from a camera pointed at a puzzle,
+// so most of the work of a frame was already done for the previous one.
+// The grid corners are tracked in a small window around their previous
+// positions (full detection on the first frame and when tracking fails),
+// a cell is recognized again only when its rectified content changed, and
+// the result only changes once the recognized givens were the same for
+// 'stable' frames, when they are solved once.
+struct FrameTracker {
+    const Config& cfg;
+    const ChamferMatcher& ref;
+    int stable;
+    bool tracking = false;
+    P corners[4];                                       // A, B, C, D as in gridCorners
+    std::array<std::array<int, 16>, 81> sig;            // 4x4 block means of the rectified cells
+    Grid digits{}, last{};                              // givens of this and the previous frame
+    std::array<double, 81> errors{};
+    int same = 0;                                       // frames with the givens equal to last
+    Result current{Result::INVALID, {}, {}};            // of the last stable givens
+    bool solved = false;
+
+    // Window radius for tracking a corner and margin for the local binarization
+    static const int radius = 24, margin = 24;
+    // A cell is recognized again when the mean of one of its 4x4 blocks
+    // changed by more than this
+    static const int changed = 12;
+
+    FrameTracker(const Config& cfg, const ChamferMatcher& ref, int stable)
+        : cfg(cfg), ref(ref), stable(stable)
+    { }
+
+    // Corner c found again: the pixel farthest from the grid center, within
+    // radius of c, of the dark component passing closest to c; false when
+    // there is none or it's on the window border (moved too far)
+    bool track(const ImageView<unsigned char>& img, P& c, P center) const {
+        int cx = c.x, cy = c.y, r = radius + margin;
+        int x0 = std::max(0, cx - r), y0 = std::max(0, cy - r),
+            x1 = std::min(img.w, cx + r + 1), y1 = std::min(img.h, cy + r + 1);
+        if (x1 - x0 < 2 || y1 - y0 < 2) return false;
+        Image<unsigned char> win = crop(img, x0, y0, x1 - x0, y1 - y0);
+        binarize(win, cfg.kblur, cfg.threshold);
+        Labeling blobs = label(win, 0);
+        auto inside = [&](const Pixel& q) { return abs(x0 + q.x - cx) <= radius && abs(y0 + q.y - cy) <= radius; };
+        int best = -1, bd2 = radius*radius*2 + 1;
+        for (int i=0; i<int(blobs.blobs.size()); i++) {
+            for (int k=blobs.first[i]; k<blobs.first[i+1]; k++) {
+                auto& run = blobs.runs[k];
+                int dy = y0 + run.y - cy, dx = std::max(0, std::max(x0 + run.x0 - cx, cx - (x0 + run.x1 - 1)));
+                if (dx*dx + dy*dy < bd2) {
+                    bd2 = dx*dx + dy*dy;
+                    best = i;
                 }
-                used[i] |= m;
-                used[9+j] |= m;
-                used[18+b] |= m;
             }
         }
+        if (best < 0) return false;
+        double bd = -1;
+        Pixel bq{0, 0};
+        for (auto& q : blobs.pixels(best)) {
+            if (!inside(q)) continue;
+            double dx = x0 + q.x + 0.5 - center.x, dy = y0 + q.y + 0.5 - center.y;
+            if (dx*dx + dy*dy > bd) {
+                bd = dx*dx + dy*dy;
+                bq = q;
+            }
+        }
+        if (bd < 0) return false;
+        if (abs(x0 + bq.x - cx) == radius || abs(y0 + bq.y - cy) == radius) return false;
+        c = P{x0 + bq.x + 0.5, y0 + bq.y + 0.5};
+        return true;
     }
 
-    auto play = [&](int i, int j, int d) {
-                    int m = 1<<(d-1), b = i/3*3 + j/3;
-                    data[i*9+j] ^= d;
-                    used[i] ^= m;
-                    used[9+j] ^= m;
-                    used[18+b] ^= m;
-                };
+    // Best digit of the candidates centered in cell (i, j), binarized and
+    // distance transformed with a margin around the cell
+    template<typename T>
+    Match cellMatch(const Image<T>& dtimg, const Image<unsigned char>& bin, int x0, int y0, int i, int j) const {
+        const int sz = cfg.sz;
+        PaddedImage<T> pad = ref.pad_image(dtimg);
+        Labeling blobs = label(bin, 0);
+        Match best{-1, double(cfg.maxerr), 0, 0};
+        for (int bi=0; bi<int(blobs.blobs.size()); bi++) {
+            const Blob& box = blobs.blobs[bi];
+            int bw = box.x1 - box.x0, bh = box.y1 - box.y0;
+            if (bh > sz/3 && bh < sz && bw > sz/8 && bw < sz) {
+                double rx = x0 + (box.x0 + box.x1)*0.5 + 0.5, ry = y0 + (box.y0 + box.y1)*0.5 + 0.5;
+                if (int(ry / sz) - 1 != i || int(rx / sz) - 1 != j) continue;
+                Stage stage("match");
+                profileCount("candidates", 1);
+                Match m = ref.match(pad, blobs.blob(bi), best.err);
+                if (m.digit >= 0) best = m;
+            }
+        }
+        return best;
+    }
 
-    std::function<bool()> solver;
-    solver = [&]()->bool {
-                 int choice = -1;
-                 for (int i=0; i<9; i++) {
-                     for (int j=0; j<9; j++) {
-                         if (data[i*9+j] == 0) {
-                             int b = i/3*3 + j/3;
-                             unsigned a = 511 - (used[i] | used[9+j] | used[18+b]);
-                             if (a == 0) return false;
-                             if ((a & (a-1)) == 0) {
-                                 int d = 1;
-                                 while (a>1) {
-                                     d++;
-                                     a = a>>1;
-                                 }
-                                 play(i, j, d);
-                                 bool s = solver();
-                                 if (!s) play(i, j, d);
-                                 return s;
-                             } else {
-                                 choice = i*9+j;
-                             }
-                         }
-                     }
-                 }
-                 if (choice == -1) return true;
-                 int i = choice/9, j = choice%9;
-                 int b = i/3*3 + j/3;
-                 unsigned u = used[i] | used[9+j] | used[18+b];
-                 for (int d=1; d<=9; d++) {
-                     if (((1<<(d-1)) & u) == 0) {
-                         play(i, j, d);
-                         bool s = solver();
-                         if (s) return true;
-                         play(i, j, d);
-                     }
-                 }
-                 return false;
-             };
-
-    bool ok = solver();
-
-    if (!ok) printf("** FAIL **\n\n");
+    void recognize(const Image<unsigned char>& rectified, int i, int j) {
+        const int sz = cfg.sz, m = sz/4;
+        int x0 = (j+1)*sz - m, y0 = (i+1)*sz - m;
+        Image<unsigned char> bin = crop(rectified, x0, y0, sz + 2*m, sz + 2*m);
+        binarize(bin, cfg.kblur, cfg.threshold);
+        Match best;
+        if (cfg.dt_mode == "euclid") {
+            Image<unsigned short> dtw = dtEuclid(bin);
+            best = cellMatch(dtw, bin, x0, y0, i, j);
+        } else {
+            Image<unsigned char> dtimg(bin);
+            if (cfg.dt_mode == "reference") dtReference(dtimg); else dt(dtimg);
+            best = cellMatch(dtimg, dtimg, x0, y0, i, j);
+        }
+        digits[i*9 + j] = best.digit + 1;
+        errors[i*9 + j] = best.digit >= 0 ? best.err : 0;
+        if (best.digit >= 0) profileCount("digits", 1);
+    }
 
-    for (int i=0; i<9; i++) {
-        for (int j=0; j<9; j++) {
-            if (data[i*9+j]) {
-                printf(" %i", data[i*9+j]);
-                if (data[i*9+j] != data0[i*9+j]) {
-                    show(i, j, data[i*9+j]-1, 0x000100);
+    Result frame(const ImageView<unsigned char>& img) {
+        profileCount("pixels", (long long)img.w*img.h);
+        P c[4] = {corners[0], corners[1], corners[2], corners[3]};
+        bool ok = tracking;
+        if (ok) {
+            Stage stage("track");
+            P center{(c[0].x + c[1].x + c[2].x + c[3].x)/4, (c[0].y + c[1].y + c[2].y + c[3].y)/4};
+            for (int k=0; k<4 && ok; k++) ok = track(img, c[k], center);
+            // and the grid didn't suddenly change size
+            auto area = [](const P *q) {
+                            return fabs((q[0].x*q[1].y - q[1].x*q[0].y) + (q[1].x*q[3].y - q[3].x*q[1].y) +
+                                        (q[3].x*q[2].y - q[2].x*q[3].y) + (q[2].x*q[0].y - q[0].x*q[2].y))/2;
+                        };
+            double a0 = area(corners), a1 = area(c);
+            ok = ok && a1 > a0*0.8 && a1 < a0*1.25;
+        }
+        profileCount("tracked", ok);
+        if (!ok && !gridCorners(img, cfg, c[0], c[1], c[2], c[3])) {
+            tracking = false;
+            return Result{Result::FAIL};
+        }
+        bool all = !ok || !tracking;
+        std::copy(c, c+4, corners);
+        tracking = true;
+
+        const int sz = cfg.sz;
+        Image<unsigned char> rectified(sz*11, sz*11);
+        {
+            Stage stage("rectify");
+            double k = 1./(sz*9), o = (0.5 - sz)*k;
+            warp(img, rectified, pixelMap(squareToQuad(c[0], c[1], c[2], c[3]), k, o, k, o));
+        }
+        for (int i=0; i<9; i++) {
+            for (int j=0; j<9; j++) {
+                std::array<int, 16> s{};
+                {
+                    Stage stage("changes");
+                    int b = sz/4;
+                    for (int y=0; y<4*b; y++) {
+                        const unsigned char *row = &rectified[size_t((i+1)*sz + y)*rectified.w + (j+1)*sz];
+                        for (int x=0; x<4*b; x++) s[(y/b)*4 + x/b] += row[x];
+                    }
+                    for (auto& v : s) v /= b*b;
                 }
-            } else {
-                printf(" .");
+                bool diff = all;
+                for (int k=0; k<16 && !diff; k++) diff = abs(s[k] - sig[i*9 + j][k]) > changed;
+                if (!diff) continue;
+                profileCount("cells", 1);
+                sig[i*9 + j] = s;
+                recognize(rectified, i, j);
             }
         }
-        printf("\n");
+
+        same = digits == last ? same + 1 : 1;
+        last = digits;
+        if (same >= stable && (!solved || digits != current.givens)) {
+            current = Result{Result::SOLVED, digits, {}, errors, {}};
+            SolverStats stats;
+            solveGrid(cfg, current, stats);
+            profileCount("nodes", stats.nodes);
+            solved = true;
+        }
+        Result r = current;
+        if (!solved) {
+            r.givens = digits;
+            r.errors = errors;
+        }
+        std::copy(c, c+4, r.corners);
+        return r;
+    }
+};
+
+// Batch mode inputs: a list file, a directory or "-" for a line-oriented
+// stdin protocol ("source [output]" per line, results flushed per image)
+struct BatchSource {
+    std::vector<std::string> names;
+    size_t next = 0;
+    FILE *f = nullptr;
+
+    BatchSource(const std::string& name) {
+        struct stat st;
+        if (name == "-") {
+            f = stdin;
+        } else if (stat(name.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (DIR *d = opendir(name.c_str())) {
+                while (dirent *e = readdir(d)) {
+                    std::string fname = name + "/" + e->d_name;
+                    if (e->d_name[0] != '.' && stat(fname.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                        names.push_back(fname);
+                    }
+                }
+                closedir(d);
+            }
+            std::sort(names.begin(), names.end());
+        } else {
+            f = fopen(name.c_str(), "r");
+            if (!f) {
+                perror("batch_name");
+                exit(1);
+            }
+        }
+    }
+
+    ~BatchSource() {
+        if (f && f != stdin) fclose(f);
     }
-    saveImage(out, output_name);
 
+    // Returns the next non-empty line (or directory entry), false at end
+    bool get(std::string& line) {
+        if (!f) {
+            if (next == names.size()) return false;
+            line = names[next++];
+            return true;
+        }
+        char buf[4096];
+        while (fgets(buf, sizeof(buf), f)) {
+            line = buf;
+            while (line.size() && isspace((unsigned char)line.back())) line.pop_back();
+            if (line.size()) return true;
+        }
+        return false;
+    }
+};
+
+std::string batchOutputName(const std::string& pattern, const std::string& src_name) {
+    size_t i = pattern.find("%s");
+    if (i == std::string::npos) return pattern;
+    std::string base = src_name.substr(src_name.rfind('/') + 1);
+    base = base.substr(0, base.rfind('.'));
+    return pattern.substr(0, i) + base + pattern.substr(i+2);
+}
+
+// Complete lines of a puzzle file in blocks of about `block` bytes: the
+// file is memory mapped, stdin ("-") is read block by block
+struct LineBlocks {
+    const char *map = nullptr;
+    size_t size = 0, pos = 0, block;
+    FILE *f = nullptr;
+    std::string carry;
+
+    LineBlocks(const std::string& name, size_t block) : block(block) {
+        if (name == "-") {
+            f = stdin;
+            return;
+        }
+        int fd = open(name.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror("puzzles_name");
+            exit(1);
+        }
+        size = st.st_size;
+        if (size) {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                perror("mmap");
+                exit(1);
+            }
+            madvise(p, size, MADV_SEQUENTIAL);
+            map = (const char *)p;
+        }
+        close(fd);
+    }
+
+    ~LineBlocks() {
+        if (map) munmap((void *)map, size);
+    }
+
+    // Sets [b, e) to the next block; stdin blocks are stored in `owned`
+    bool get(std::string& owned, const char *& b, const char *& e) {
+        if (!f) {
+            if (pos == size) return false;
+            size_t end = std::min(size, pos + block);
+            while (end < size && map[end-1] != '\n') end++;
+            b = map + pos; e = map + end;
+            pos = end;
+            return true;
+        }
+        owned.swap(carry);
+        carry.clear();
+        owned.resize(owned.size() + block);
+        size_t n = owned.size() - block;
+        n += fread(&owned[n], 1, block, f);
+        owned.resize(n);
+        if (n == 0) return false;
+        size_t last = owned.rfind('\n');
+        if (last != std::string::npos && !feof(f)) {
+            carry = owned.substr(last+1);
+            owned.resize(last+1);
+        }
+        b = owned.data(); e = b + owned.size();
+        return true;
+    }
+};
+
+// Solves an 81 characters puzzle, false if it can't be parsed
+bool solvePuzzle(const Config& cfg, const std::string& puzzle, Result& r) {
+    r = Result{Result::SOLVED, {}, {}};
+    if (!parseGrid(puzzle.c_str(), puzzle.size(), &r.givens[0])) return false;
+    SolverStats stats;
+    solveGrid(cfg, r, stats);
+    return true;
+}
+
+// Solves a file of puzzles in the 81 characters format writing solutions in
+// the same order and format; lines that can't be parsed or solved are copied
+// unchanged to the output
+int solvePuzzles(const Config& cfg, const std::string& input, const std::string& output, int threads) {
+    FILE *out = output == "-" ? stdout : fopen(output.c_str(), "w");
+    if (!out) {
+        perror("solutions_name");
+        return 1;
+    }
+    auto solver = makeSolver(cfg.solver);
+    LineBlocks blocks(input, 1 << 20);
+    OrderedOutput ordered(out);
+    ThreadPool pool(threads);
+    std::atomic<long long> solved{0}, unsolvable{0}, invalid{0};
+    auto t0 = std::chrono::steady_clock::now();
+    std::string owned;
+    const char *b, *e;
+    for (int index=0; blocks.get(owned, b, e); index++) {
+        auto data = std::make_shared<std::string>();
+        data->swap(owned);
+        pool.submit([&, data, b, e, index](){
+                        std::string res;
+                        res.reserve(e - b);
+                        int grid[81];
+                        long long ns = 0, nu = 0, ni = 0;
+                        for (const char *p=b; p<e;) {
+                            const char *nl = (const char *)memchr(p, '\n', e - p), *le = nl ? nl : e;
+                            size_t n = le - p - (le > p && le[-1] == '\r');
+                            SolverStats stats;
+                            if (!parseGrid(p, n, grid) || !validGrid(grid)) {
+                                ni++;
+                                res.append(p, n);
+                            } else if (!solver->solve(grid, stats)) {
+                                nu++;
+                                res.append(p, n);
+                            } else {
+                                ns++;
+                                for (int i=0; i<81; i++) res += char('0' + grid[i]);
+                            }
+                            res += '\n';
+                            p = le + 1;
+                        }
+                        solved += ns; unsolvable += nu; invalid += ni;
+                        ordered.put(index, std::move(res));
+                    });
+        // Bound the memory used by blocks waiting to be written
+        if (index % (4*pool.size()) == 4*pool.size()-1) pool.wait();
+    }
+    pool.wait();
+    if (out != stdout) fclose(out);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    long long total = solved + unsolvable + invalid;
+    fprintf(stderr, "%lli puzzles (%lli unsolvable, %lli invalid) in %.3f s, %.0f puzzles/sec on %i threads\n",
+            total, (long long)unsolvable, (long long)invalid, secs, total / std::max(secs, 1e-9), pool.size());
+    return 0;
+}
+
+int run(int argc, const char *argv[]) {
+    Config cfg;
+    PARM(std::string, src_name, "Source filename", "input.pgm");
+    PARM(std::string, output_name, "Output filename", "out.ppm");
+    PARM(std::string, puzzle, "Solve an 81 characters puzzle ('.' or '0' for empty cells) and exit", "");
+    PARM(std::string, puzzles_name, "Solve a file of 81 characters puzzles ('-' for stdin), one per line", "");
+    PARM(std::string, solutions_name, "Output file for --puzzles_name solutions ('-' for stdout)", "-");
+    PARM(std::string, batch_name, "Batch mode: list of source files, directory or '-' for stdin", "");
+    PARM(std::string, batch_output, "Batch output filename pattern ('%s' is the source basename)", "");
+    PARM(int, threads, "Batch and puzzle file worker threads (0 = all cores)", "0");
+    PARM(std::string, profile_name, "Write per-image stage timings and counters as JSON to this file", "");
+    PARM(std::string, frames_name, "Sequence mode: concatenated binary PGM/PPM frames ('-' for stdin) or a numbered file pattern (frame%04d.pgm)", "");
+    PARM(int, stable_frames, "Sequence mode frames with the same recognized givens before they are solved", "3");
+    PARM(std::string, socket_name, "Serve IMAGE and PUZZLE requests on this Unix domain socket (see server.h)", "");
+    PARM(int, queue_size, "Server requests waiting for a worker before further ones are rejected", "16");
+    PARM(int, max_connections, "Server clients connected at once before further ones are rejected", "64");
+    PARM(int, client_timeout, "Seconds a server client may leave a read or write blocked before it is closed", "30");
+    PARM(int, max_image_mb, "Largest encoded image accepted by the server, in MB", "32");
+    PARM(int, cell_cache_size, "Cached digit matches of rectified cells (0 = no cache)", "16384");
+    PARM(int, grid_cache_size, "Cached solutions of recognized grids (0 = no cache)", "1024");
+    PARM(std::string, cache_name, "Load the caches from this file at startup and save them to it at exit (server: on SIGTERM or SIGINT)", "");
+    PARM(std::string, simd, "Vector instruction set (auto, avx2, sse2 or none)", "auto");
+    MPARM(cfg, digits_name, "Digits reference filename", "digits.pgm");
+    MPARM(cfg, bank_name, "Digit template bank filename (empty = build it from --digits_name)", "");
+    PARM(std::string, compile_bank, "Compile the digit template bank of --digits_name to this file and exit", "");
+    MPARM(cfg, debug_name, "Debug output filename", "");
+    MPARM(cfg, binarized_name, "Binarized rectified filename", "");
+    MPARM(cfg, binarized_dt_name, "DT-transformed rectified filename", "");
+    MPARM(cfg, digits_dt_name, "DT-transformed digits filename", "");
+    MPARM(cfg, kblur, "Blur constant", "0.95");
+    MPARM(cfg, threshold, "Binarization threshold", "0.8");
+    MPARM(cfg, sz, "Rectified cell size", "100");
+    MPARM(cfg, maxerr, "Maximum error threshold", "50");
+    MPARM(cfg, match_threads, "Threads matching the digits of one image (0 = all cores; serial in batch mode)", "0");
+    MPARM(cfg, levels, "Pyramid levels for grid detection (-1 = until the longest side is at most 1024)", "-1");
+    MPARM(cfg, refine_steps, "Random-walk refinement steps of the camera fit", "0");
+    MPARM(cfg, solver, "Solver engine (bitboard or backtrack)", "bitboard");
+    MPARM(cfg, count_solutions, "Count solutions up to this many (1 = stop at the first, 2 = check uniqueness, 0 = all)", "1");
+    MPARM(cfg, solver_threads, "Threads splitting the search tree when counting solutions (0 = all cores; serial in batch mode)", "0");
+    MPARM(cfg, repair_candidates, "Digits tried for each given when repairing an invalid or unsolvable recognized grid", "3");
+    MPARM(cfg, repair_limit, "Alternative givens checked by the repair of an invalid or unsolvable grid (0 = no repair)", "2000");
+    MPARM(cfg, repair_cells, "Maximum givens changed by a repair", "3");
+    MPARM(cfg, repair_cost, "Maximum total extra match error of the alternative givens of a repair", "10");
+    MPARM(cfg, dt_mode, "Distance transform of the rectified image (chamfer, reference or euclid)", "chamfer");
+    MPARM(cfg, input_scale, "Scale input images by this factor before processing (synthetic variants)", "1");
+    MPARM(cfg, input_rotate, "Rotate input images clockwise by this many degrees before processing", "0");
+    MPARM(cfg, results, "Results only: write no images and print givens, match errors, corners and solution (json or binary)", "");
+
+    parse_argv("sudoku", argc, argv);
+    set_simd(simd);
+    if (cfg.dt_mode != "chamfer" && cfg.dt_mode != "reference" && cfg.dt_mode != "euclid") {
+        throw std::runtime_error("Unknown distance transform '" + cfg.dt_mode + "'");
+    }
+    if (cfg.results != "" && cfg.results != "json" && cfg.results != "binary") {
+        throw std::runtime_error("Unknown results format '" + cfg.results + "'");
+    }
+    if (!(cfg.input_scale > 0)) throw std::runtime_error("Invalid input scale");
+    if (!(cfg.kblur < 1)) throw std::runtime_error("Invalid blur constant (must be below 1)");
+    if (cell_cache_size < 0 || grid_cache_size < 0) throw std::runtime_error("Invalid cache size");
+    if (cfg.count_solutions < 0) throw std::runtime_error("Invalid solution count limit");
+    if (max_connections < 1 || client_timeout < 1 || max_image_mb < 1 || max_image_mb > 4095) throw std::runtime_error("Invalid server limits");
+    solved_grids().resize(grid_cache_size);
+    // batch and puzzle file workers already keep all cores busy
+    if (cfg.count_solutions != 1 && batch_name == "" && puzzles_name == "" && default_threads(cfg.solver_threads) > 1) {
+        solver_workers().reset(new ThreadPool(default_threads(cfg.solver_threads) - 1));
+    }
+    // Output for an image, r is null when processing failed
+    auto format = [&](const std::string& name, const Result *r, const std::string& error) {
+                      if (cfg.results == "json") return resultJSON(name, r, error);
+                      if (cfg.results == "binary") return resultBinary(name, r);
+                      return "# " + name + "\n" + (r ? formatResult(*r) : "Error: " + error + "\n") + "\n";
+                  };
+
+    if (puzzle != "") {
+        Result r;
+        if (!solvePuzzle(cfg, puzzle, r)) {
+            fprintf(stderr, "Invalid puzzle '%s'\n", puzzle.c_str());
+            return 1;
+        }
+        fputs(formatResult(r).c_str(), stdout);
+        return r.status != Result::SOLVED;
+    }
+
+    if (puzzles_name != "") return solvePuzzles(cfg, puzzles_name, solutions_name, threads);
+
+    if (compile_bank != "") {
+        writeFile(compile_bank, compileBank(cfg));
+        return 0;
+    }
+
+    ChamferMatcher ref(loadReference(cfg), cfg.sz);
+    ref.cells.resize(cell_cache_size);
+    // batch workers already keep all cores busy
+    if (batch_name == "") ref.startWorkers(cfg.match_threads);
+    if (cache_name != "") loadCaches(cache_name, ref);
+    auto cacheStats = [&]() {
+                          if (cell_cache_size || grid_cache_size) {
+                              fprintf(stderr, "cache: cells %lld hits %lld misses, grids %lld hits %lld misses\n",
+                                      (long long)ref.cells.hits, (long long)ref.cells.misses,
+                                      (long long)solved_grids().hits, (long long)solved_grids().misses);
+                          }
+                          if (cache_name != "") saveCaches(cache_name, ref);
+                      };
+
+    if (socket_name != "") {
+        // IMAGE size [name] with the encoded image as payload, or PUZZLE
+        // <81 chars>; replies are --results json lines
+        Config scfg = cfg;
+        scfg.results = "json";
+        Server server(socket_name, threads, queue_size, max_connections, client_timeout, {"IMAGE"}, size_t(max_image_mb) << 20,
+                      [&](const Request& req) -> std::string {
+                          const std::string& cmd = req.words[0];
+                          if (cmd == "IMAGE") {
+                              ArenaScope arena(&worker_arena());
+                              Result r = processImage(scfg, ref, decodeImage<unsigned char>(req.payload.data(), req.payload.size()), "");
+                              return resultJSON(req.words.size() > 2 ? req.words[2] : "", &r, "");
+                          }
+                          Result r;
+                          if (cmd == "PUZZLE" && req.words.size() == 2 && solvePuzzle(cfg, req.words[1], r)) {
+                              return std::string("{\"status\": \"") + statusName(r.status) + "\", \"givens\": " +
+                                  jsonGrid(r.givens) + ", \"solution\": " +
+                                  (r.status == Result::INVALID ? "null" : jsonGrid(r.solution)) + jsonCount(r) + "}\n";
+                          }
+                          throw std::runtime_error(cmd == "PUZZLE" ? "Invalid puzzle" : "Unknown request '" + cmd + "'");
+                      });
+        server.run();
+        // Connection threads may still be using the server and the caches:
+        // save them and leave without destroying anything
+        cacheStats();
+        fflush(stdout);
+        _exit(0);
+    }
+
+    ProfileReport report;
+    auto process = [&](int index, const std::string& name, const std::string& out_name) {
+                       Profile prof;
+                       Result r;
+                       const char *status = "error";
+                       std::exception_ptr error;
+                       {
+                           ProfileScope scope(profile_name != "" ? &prof : nullptr);
+                           long long allocs = heap_allocations();
+                           try {
+                               ArenaScope arena(&worker_arena());
+                               r = processImage(cfg, ref, name, out_name);
+                               status = statusName(r.status);
+                           } catch (...) {
+                               error = std::current_exception();
+                           }
+                           profileCount("allocations", heap_allocations() - allocs);
+                       }
+                       if (profile_name != "") report.add(index, name, status, prof);
+                       if (error) std::rethrow_exception(error);
+                       return r;
+                   };
+
+    if (frames_name != "") {
+        FrameSource frames(frames_name);
+        FrameTracker tracker(cfg, ref, std::max(1, stable_frames));
+        MappedImage img;
+        Scratch<unsigned char> buf;
+        std::string name;
+        auto t0 = std::chrono::steady_clock::now();
+        int count = 0;
+        for (;; count++) {
+            Profile prof;
+            Result r;
+            {
+                ProfileScope scope(profile_name != "" ? &prof : nullptr);
+                long long allocs = heap_allocations();
+                ArenaScope arena(&worker_arena());
+                {
+                    Stage stage("load");
+                    img = MappedImage();
+                    if (!frames.next(img, buf, name)) break;
+                }
+                r = tracker.frame(img.view);
+                img = MappedImage();
+                profileCount("allocations", heap_allocations() - allocs);
+            }
+            if (profile_name != "") report.add(count, name, statusName(r.status), prof);
+            std::string s = format(name, &r, "");
+            fwrite(s.data(), 1, s.size(), stdout);
+            fflush(stdout);
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        fprintf(stderr, "%i frames in %.3f s, %.2f frames/sec\n", count, secs, count / std::max(secs, 1e-9));
+        cacheStats();
+        if (profile_name != "") {
+            report.print(stderr);
+            report.write(profile_name);
+        }
+        return 0;
+    }
+
+    if (batch_name == "") {
+        Result r = process(0, src_name, output_name);
+        std::string s = cfg.results != "" ? format(src_name, &r, "") : formatResult(r);
+        fwrite(s.data(), 1, s.size(), stdout);
+        if (profile_name != "") report.write(profile_name);
+        if (cache_name != "") saveCaches(cache_name, ref);
+        return r.status == Result::INVALID;
+    }
+
+    BatchSource batch(batch_name);
+    OrderedOutput output(stdout);
+    ThreadPool pool(threads);
+    std::atomic<int> errors{0};
+    auto t0 = std::chrono::steady_clock::now();
+    int count = 0;
+    std::string line;
+    while (batch.get(line)) {
+        std::string name = line, out_name = batchOutputName(batch_output, line);
+        size_t sp = line.find(' ');
+        if (batch.f == stdin && sp != std::string::npos) {
+            name = line.substr(0, sp);
+            out_name = line.substr(line.find_first_not_of(' ', sp));
+        }
+        pool.submit([&, name, out_name, index=count](){
+                        std::string s;
+                        try {
+                            Result r = process(index, name, out_name);
+                            s = format(name, &r, "");
+                        } catch (std::exception& e) {
+                            s = format(name, nullptr, e.what());
+                            errors++;
+                        }
+                        output.put(index, s);
+                    });
+        count++;
+    }
+    pool.wait();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    fprintf(stderr, "%i images (%i errors) in %.3f s, %.2f images/sec on %i threads\n",
+            count, int(errors), secs, count / std::max(secs, 1e-9), pool.size());
+    cacheStats();
+    if (profile_name != "") {
+        report.print(stderr);
+        report.write(profile_name);
+    }
     return 0;
 }
+
+// Invalid options and inputs end with a message like the argument parser does
+int main(int argc, const char *argv[]) {
+    try {
+        return run(argc, argv);
+    } catch (std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+}
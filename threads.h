@@ -0,0 +1,166 @@
+#if !defined(THREADS_H_INCLUDED)
+#define THREADS_H_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline int default_threads(int n) {
+    return n > 0 ? n : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Thread pool with one task deque per worker. Workers pop from the front of
+// their own deque and, when empty, steal from the back of the others so a
+// slow task never holds back the ones queued behind it.
+struct ThreadPool {
+    struct alignas(64) Queue {
+        std::mutex m;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex m;
+    std::condition_variable wake, done;
+    int pending = 0, queued = 0;
+    std::atomic<size_t> next{0};               // submit() may be called by several threads
+    bool stop = false;
+    std::exception_ptr error;
+
+    ThreadPool(int n) {
+        n = default_threads(n);
+        for (int i=0; i<n; i++) queues.emplace_back(new Queue);
+        for (int i=0; i<n; i++) threads.emplace_back([this, i](){ run(i); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    int size() const { return int(threads.size()); }
+
+    void submit(std::function<void()> task) {
+        Queue& q = *queues[next++ % queues.size()];
+        {
+            std::lock_guard<std::mutex> lock(q.m);
+            q.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(m);
+            pending++;
+            queued++;
+        }
+        wake.notify_one();
+    }
+
+    // Waits for all submitted tasks, rethrowing the first exception raised by one
+    void wait() {
+        std::unique_lock<std::mutex> lock(m);
+        done.wait(lock, [&](){ return pending == 0; });
+        if (error) {
+            auto e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    bool take(int id, std::function<void()>& task) {
+        int n = int(queues.size());
+        for (int k=0; k<n; k++) {
+            Queue& q = *queues[(id + k) % n];
+            std::lock_guard<std::mutex> lock(q.m);
+            if (q.tasks.size()) {
+                if (k == 0) {
+                    task = std::move(q.tasks.front());
+                    q.tasks.pop_front();
+                } else {
+                    task = std::move(q.tasks.back());
+                    q.tasks.pop_back();
+                }
+                std::lock_guard<std::mutex> glock(m);
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(int id) {
+        std::function<void()> task;
+        for (;;) {
+            if (take(id, task)) {
+                try {
+                    task();
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(m);
+                    if (!error) error = std::current_exception();
+                }
+                task = nullptr;
+                std::lock_guard<std::mutex> lock(m);
+                if (--pending == 0) done.notify_all();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m);
+            wake.wait(lock, [&](){ return stop || queued > 0; });
+            if (stop) return;
+        }
+    }
+};
+
+// Scope of pool tasks needing no per-thread setup
+struct NoScope {};
+
+// Runs f(i) for every i in [0, n) on the calling thread helped by tasks of
+// a long-lived pool, which other threads may be using at the same time:
+// indices are taken one at a time and only these tasks are waited for.
+// Pool tasks run inside a Scope object (per-thread setup, such as an
+// arena); the first exception raised by f is rethrown.
+template<typename Scope = NoScope, typename F>
+void parallel_for(ThreadPool& pool, int n, F f) {
+    struct Shared {
+        std::atomic<int> next{0};
+        std::mutex m;
+        std::condition_variable done;
+        int running = 0;
+        std::exception_ptr error;
+    } s;
+    auto work = [&s, n, &f]() {
+                    try {
+                        for (int i; (i = s.next++) < n; ) f(i);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(s.m);
+                        if (!s.error) s.error = std::current_exception();
+                        s.next = n;
+                    }
+                };
+    s.running = std::max(0, std::min(pool.size(), n - 1));
+    for (int k=s.running; k>0; k--) {
+        pool.submit([&s, &work](){
+                        {
+                            Scope scope;
+                            (void)scope;
+                            work();
+                        }
+                        std::lock_guard<std::mutex> lock(s.m);
+                        if (--s.running == 0) s.done.notify_all();
+                    });
+    }
+    work();
+    std::unique_lock<std::mutex> lock(s.m);
+    s.done.wait(lock, [&](){ return s.running == 0; });
+    if (s.error) std::rethrow_exception(s.error);
+}
+
+#endif